@@ -4,8 +4,11 @@
 #include <string.h>
 #include <time.h>
 #include <util.h>
+#include <mqlog.h>
 
-int producer_bench(size_t, size_t, size_t);
+int producer_bench(size_t, size_t, size_t, unsigned int);
+int concurrent_producer_bench(size_t, size_t, size_t, size_t, unsigned int);
+int producer_batch_bench(size_t, size_t, size_t, size_t, unsigned int);
 
 void err(const char* fmt, ...) {
     va_list args;
@@ -26,10 +29,13 @@ int main(int argc, char* argv[]) {
     size_t segment_size = 524288000;  // default to 512MB
     size_t num = 50000000;  // default to 50M
     size_t size = 100;  // default to 100bytes
+    size_t producers = 4;  // default to 4 threads
+    size_t batch = 32;  // default to 32 payloads per batch
+    unsigned int flags = 0;  // default to the mmap engine
 
     char c;
     char* benchmark = NULL;
-    while ((c = getopt(argc, argv, "b:n:s:")) != -1) {
+    while ((c = getopt(argc, argv, "b:n:s:p:k:e:")) != -1) {
         switch (c) {
             case 'b':
                 benchmark = optarg;
@@ -40,6 +46,21 @@ int main(int argc, char* argv[]) {
             case 's':
                 size = atoi(optarg);
                 break;
+            case 'p':
+                producers = atoi(optarg);
+                break;
+            case 'k':
+                batch = atoi(optarg);
+                break;
+            case 'e':
+                if (strcmp(optarg, "pwrite") == 0) {
+                    flags = MQLOG_PWRITE;
+                } else if (strcmp(optarg, "direct") == 0) {
+                    flags = MQLOG_DIRECT;
+                } else if (strcmp(optarg, "mmap") != 0) {
+                    err("Unknown engine `%s'.\n", optarg);
+                }
+                break;
             case '?':
                 err("Unknown option character `\\x%x'.\n", optopt);
         }
@@ -50,10 +71,31 @@ int main(int argc, char* argv[]) {
     }
 
     if (strncmp(benchmark, "producer_bench", strlen("producer_bench")) == 0) {
-        if (producer_bench(segment_size, num, size) != 0) {
+        if (producer_bench(segment_size, num, size, flags) != 0) {
             err("producer_bench test failed\n");
         }
     }
 
+    if (strncmp(benchmark,
+                "concurrent_producer_bench",
+                strlen("concurrent_producer_bench")) == 0) {
+        if (concurrent_producer_bench(segment_size,
+                                      num,
+                                      size,
+                                      producers,
+                                      flags) != 0) {
+            err("concurrent_producer_bench test failed\n");
+        }
+    }
+
+    if (strncmp(benchmark,
+                "producer_batch_bench",
+                strlen("producer_batch_bench")) == 0) {
+        if (producer_batch_bench(segment_size, num, size, batch,
+                                 flags) != 0) {
+            err("producer_batch_bench test failed\n");
+        }
+    }
+
     return 0;
 }
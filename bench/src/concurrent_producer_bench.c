@@ -0,0 +1,97 @@
+#include "bench_util.h"
+#include <stdlib.h>
+#include <pthread.h>
+#include <mqlog.h>
+#include <util.h>
+
+struct producer_args {
+    mqlog_t*             lg;
+    size_t               num;
+    size_t               size;
+    const unsigned char* block;
+    int                  rc;
+};
+
+static void* producer(void* arg) {
+    struct producer_args* args = (struct producer_args*)arg;
+
+    for (size_t i = 0; i < args->num; ++i) {
+        const ssize_t written = mqlog_write(args->lg, args->block, args->size);
+        if (written == ELLOCK) {
+            // a segment roll is in progress
+            --i;
+            continue;
+        }
+        if ((size_t)written != args->size) {
+            args->rc = -1;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+int concurrent_producer_bench(size_t segment_size,
+                              size_t num,
+                              size_t size,
+                              size_t producers,
+                              unsigned int flags) {
+    unsigned char* block = random_block(size);
+    if (!block) {
+        return -1;
+    }
+
+    const char* dir = "/tmp/concurrent_producer_bench";
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, segment_size, flags);
+    if (rc != 0) {
+        return -1;
+    }
+
+    pthread_t threads[producers];
+    struct producer_args args[producers];
+    for (size_t i = 0; i < producers; ++i) {
+        struct producer_args a = {
+            .lg = lg,
+            .num = num / producers,
+            .size = size,
+            .block = block,
+            .rc = 0
+        };
+        args[i] = a;
+    }
+
+    struct timespec tsr, tsb, tse;
+    if (clock_gettime(CLOCK_REALTIME, &tsb) < 0) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < producers; ++i) {
+        if (pthread_create(&threads[i], NULL, producer, &args[i]) != 0) {
+            return -1;
+        }
+    }
+
+    for (size_t i = 0; i < producers; ++i) {
+        if (pthread_join(threads[i], NULL) != 0 || args[i].rc != 0) {
+            return -1;
+        }
+    }
+
+    if (clock_gettime(CLOCK_REALTIME, &tse) < 0) {
+        return -1;
+    }
+
+    tsr.tv_sec = tse.tv_sec - tsb.tv_sec;
+    tsr.tv_nsec = tse.tv_nsec - tsb.tv_nsec;
+
+    const size_t ops = num / producers * producers;
+    print_report(__func__, tsr, ops, ops * size);
+
+    mqlog_close(lg);
+    free(block);
+
+    return 0;
+}
@@ -3,7 +3,10 @@
 #include <mqlog.h>
 #include <util.h>
 
-int producer_bench(size_t segment_size, size_t num, size_t size) {
+int producer_bench(size_t segment_size,
+                   size_t num,
+                   size_t size,
+                   unsigned int flags) {
     unsigned char* block = random_block(size);
     if (!block) {
         return -1;
@@ -14,7 +17,7 @@ int producer_bench(size_t segment_size, size_t num, size_t size) {
 
 
     mqlog_t* lg = NULL;
-    int rc = mqlog_open(&lg, dir, segment_size, 0);
+    int rc = mqlog_open(&lg, dir, segment_size, flags);
     if (rc != 0) {
         return -1;
     }
@@ -45,3 +48,62 @@ int producer_bench(size_t segment_size, size_t num, size_t size) {
 
     return 0;
 }
+
+int producer_batch_bench(size_t segment_size,
+                         size_t num,
+                         size_t size,
+                         size_t batch,
+                         unsigned int flags) {
+    unsigned char* block = random_block(size);
+    if (!block) {
+        return -1;
+    }
+
+    struct iovec* iov = calloc(batch, sizeof(struct iovec));
+    if (!iov) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < batch; ++i) {
+        iov[i].iov_base = block;
+        iov[i].iov_len = size;
+    }
+
+    const char* dir = "/tmp/producer_batch_bench";
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, segment_size, flags);
+    if (rc != 0) {
+        return -1;
+    }
+
+    struct timespec tsr, tsb, tse;
+    if (clock_gettime(CLOCK_REALTIME, &tsb) < 0) {
+        return -1;
+    }
+
+    uint64_t offset;
+    for (size_t i = 0; i < num / batch; ++i) {
+        const ssize_t written = mqlog_writev(lg, iov, batch, &offset);
+        if ((size_t)written != size * batch) {
+            return -1;
+        }
+    }
+
+    if (clock_gettime(CLOCK_REALTIME, &tse) < 0) {
+        return -1;
+    }
+
+    tsr.tv_sec = tse.tv_sec - tsb.tv_sec;
+    tsr.tv_nsec = tse.tv_nsec - tsb.tv_nsec;
+
+    const size_t ops = num / batch * batch;
+    print_report(__func__, tsr, ops, ops * size);
+
+    mqlog_close(lg);
+    free(iov);
+    free(block);
+
+    return 0;
+}
@@ -0,0 +1,259 @@
+#include "crc32c.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#include <wmmintrin.h>
+#define CRC32C_HW
+#endif
+
+// Castagnoli polynomial, bit reflected.
+#define POLY 0x82f63b78
+
+typedef uint32_t (*crc32c_fn)(uint32_t,
+                              unsigned char*,
+                              const unsigned char*,
+                              size_t);
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static crc32c_fn impl = NULL;
+
+// Slicing-by-8 tables, `table[0]` is the byte-at-a-time table.
+static uint32_t table[8][256];
+
+static uint64_t load64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t sw(uint32_t crc,
+                   unsigned char* dst,
+                   const unsigned char* src,
+                   size_t size) {
+    while (size >= 8) {
+        // Little endian only, like the rest of the frame format.
+        const uint64_t v = load64(src) ^ crc;
+        if (dst) {
+            memcpy(dst, src, 8);
+            dst += 8;
+        }
+
+        crc = table[7][v & 0xff] ^
+              table[6][(v >> 8) & 0xff] ^
+              table[5][(v >> 16) & 0xff] ^
+              table[4][(v >> 24) & 0xff] ^
+              table[3][(v >> 32) & 0xff] ^
+              table[2][(v >> 40) & 0xff] ^
+              table[1][(v >> 48) & 0xff] ^
+              table[0][v >> 56];
+
+        src += 8;
+        size -= 8;
+    }
+
+    while (size--) {
+        if (dst) {
+            *dst++ = *src;
+        }
+        crc = table[0][(crc ^ *src++) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef CRC32C_HW
+
+// Buffers long enough are split in three lanes whose checksums are
+// calculated in parallel: the `crc32` instruction has a latency of
+// three cycles but a throughput of one per cycle.
+enum { LONG_LANE = 8192, SHORT_LANE = 256 };
+
+// x^(8n - 33) mod P, shifting a checksum by n zero bytes.
+static uint32_t long_shift[2];
+static uint32_t short_shift[2];
+
+__attribute__((target("sse4.2")))
+static uint32_t hw(uint32_t crc,
+                   unsigned char* dst,
+                   const unsigned char* src,
+                   size_t size) {
+    uint64_t crc64 = crc;
+    while (size >= 8) {
+        const uint64_t v = load64(src);
+        if (dst) {
+            memcpy(dst, &v, 8);
+            dst += 8;
+        }
+        crc64 = _mm_crc32_u64(crc64, v);
+        src += 8;
+        size -= 8;
+    }
+
+    crc = (uint32_t)crc64;
+    while (size--) {
+        if (dst) {
+            *dst++ = *src;
+        }
+        crc = _mm_crc32_u8(crc, *src++);
+    }
+
+    return crc;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t shift(uint32_t crc, uint32_t k) {
+    const __m128i product = _mm_clmulepi64_si128(_mm_cvtsi32_si128((int)crc),
+                                                 _mm_cvtsi32_si128((int)k),
+                                                 0);
+    return (uint32_t)_mm_crc32_u64(0, (uint64_t)_mm_cvtsi128_si64(product));
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static size_t lanes(uint32_t* crc,
+                    unsigned char* dst,
+                    const unsigned char* src,
+                    size_t size,
+                    size_t lane,
+                    const uint32_t k[2]) {
+    size_t done = 0;
+    while (size - done >= 3 * lane) {
+        uint64_t a = *crc;
+        uint64_t b = 0;
+        uint64_t c = 0;
+
+        const unsigned char* p = src + done;
+        unsigned char* q = dst ? dst + done : NULL;
+        for (size_t i = 0; i < lane; i += 8) {
+            const uint64_t va = load64(p + i);
+            const uint64_t vb = load64(p + lane + i);
+            const uint64_t vc = load64(p + 2 * lane + i);
+            if (q) {
+                memcpy(q + i, &va, 8);
+                memcpy(q + lane + i, &vb, 8);
+                memcpy(q + 2 * lane + i, &vc, 8);
+            }
+            a = _mm_crc32_u64(a, va);
+            b = _mm_crc32_u64(b, vb);
+            c = _mm_crc32_u64(c, vc);
+        }
+
+        *crc = shift((uint32_t)a, k[1]) ^ shift((uint32_t)b, k[0]) ^
+               (uint32_t)c;
+        done += 3 * lane;
+    }
+
+    return done;
+}
+
+__attribute__((target("sse4.2,pclmul")))
+static uint32_t hw_pclmul(uint32_t crc,
+                          unsigned char* dst,
+                          const unsigned char* src,
+                          size_t size) {
+    size_t done = lanes(&crc, dst, src, size, LONG_LANE, long_shift);
+    done += lanes(&crc,
+                  dst ? dst + done : NULL,
+                  src + done,
+                  size - done,
+                  SHORT_LANE,
+                  short_shift);
+
+    return hw(crc, dst ? dst + done : NULL, src + done, size - done);
+}
+
+#endif
+
+// a * b mod P
+static uint32_t multmodp(uint32_t a, uint32_t b) {
+    uint32_t m = (uint32_t)1 << 31;
+    uint32_t p = 0;
+    for (;;) {
+        if (a & m) {
+            p ^= b;
+            if ((a & (m - 1)) == 0) {
+                break;
+            }
+        }
+        m >>= 1;
+        b = b & 1 ? (b >> 1) ^ POLY : b >> 1;
+    }
+
+    return p;
+}
+
+// x^n mod P
+static uint32_t xnmodp(uint64_t n) {
+    uint32_t p = (uint32_t)1 << 31;  // x^0
+    uint32_t x = (uint32_t)1 << 30;  // x^1
+    while (n) {
+        if (n & 1) {
+            p = multmodp(p, x);
+        }
+        x = multmodp(x, x);
+        n >>= 1;
+    }
+
+    return p;
+}
+
+static void init() {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t crc = i;
+        for (int j = 0; j < 8; ++j) {
+            crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        table[0][i] = crc;
+    }
+
+    for (uint32_t i = 0; i < 256; ++i) {
+        for (int j = 1; j < 8; ++j) {
+            table[j][i] = table[0][table[j - 1][i] & 0xff] ^
+                          (table[j - 1][i] >> 8);
+        }
+    }
+
+    impl = sw;
+
+#ifdef CRC32C_HW
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) {
+        impl = hw;
+
+        if (__builtin_cpu_supports("pclmul")) {
+            long_shift[0] = xnmodp(8 * LONG_LANE - 33);
+            long_shift[1] = xnmodp(2 * 8 * LONG_LANE - 33);
+            short_shift[0] = xnmodp(8 * SHORT_LANE - 33);
+            short_shift[1] = xnmodp(2 * 8 * SHORT_LANE - 33);
+            impl = hw_pclmul;
+        }
+    }
+#else
+    // Only needed by the hardware implementation.
+    (void)xnmodp;
+#endif
+}
+
+static crc32c_fn resolve() {
+    pthread_once(&once, init);
+    return impl;
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t size) {
+    const crc32c_fn fn = resolve();
+    return fn(crc ^ ~0U, NULL, (const unsigned char*)buf, size) ^ ~0U;
+}
+
+uint32_t crc32c_copy(uint32_t crc, void* dst, const void* src, size_t size) {
+    const crc32c_fn fn = resolve();
+    return fn(crc ^ ~0U,
+              (unsigned char*)dst,
+              (const unsigned char*)src,
+              size) ^ ~0U;
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void* buf, size_t size) {
+    resolve();
+    return sw(crc ^ ~0U, NULL, (const unsigned char*)buf, size) ^ ~0U;
+}
@@ -0,0 +1,21 @@
+#ifndef MQLOG_CRC32C_H_
+#define MQLOG_CRC32C_H_
+
+#include <inttypes.h>
+#include <stddef.h>
+
+/*
+ * CRC32C (Castagnoli). The implementation is picked at runtime:
+ * SSE4.2 `crc32` instructions, combined with PCLMUL for long buffers,
+ * or a portable slicing-by-8 fallback.
+ */
+
+uint32_t crc32c(uint32_t, const void*, size_t);
+
+/* copies `size` bytes to `dst` while calculating their checksum */
+uint32_t crc32c_copy(uint32_t, void*, const void*, size_t);
+
+/* portable implementation, whatever the CPU supports */
+uint32_t crc32c_sw(uint32_t, const void*, size_t);
+
+#endif
@@ -0,0 +1,45 @@
+#include "futex.h"
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+int futex_wait(volatile uint32_t* addr,
+               uint32_t expected,
+               const struct timespec* timeout) {
+    // The kernel compares `*addr` with `expected` atomically,
+    // a wake up in between can't be lost.
+    const long rc = syscall(SYS_futex,
+                            (uint32_t*)addr,
+                            FUTEX_WAIT_PRIVATE,
+                            expected,
+                            timeout,
+                            NULL,
+                            0);
+    if (rc == -1 && errno == ETIMEDOUT) {
+        return -1;
+    }
+
+    // EAGAIN (value changed) and EINTR are treated as wake ups.
+    return 0;
+}
+
+int futex_wake(volatile uint32_t* addr, int waiters) {
+    return syscall(SYS_futex,
+                   (uint32_t*)addr,
+                   FUTEX_WAKE_PRIVATE,
+                   waiters,
+                   NULL,
+                   NULL,
+                   0);
+}
+
+void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#else
+    __sync_synchronize();
+#endif
+}
@@ -0,0 +1,19 @@
+#ifndef MQLOG_FUTEX_H_
+#define MQLOG_FUTEX_H_
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Thin wrappers around the Linux futex syscall, used to park threads
+ * after a bounded amount of spinning.
+ */
+
+/* returns 0 when woken up or if `*addr != expected`, -1 on timeout */
+int  futex_wait(volatile uint32_t*, uint32_t, const struct timespec*);
+int  futex_wake(volatile uint32_t*, int);
+
+/* CPU hint for spin-wait loops */
+void cpu_relax();
+
+#endif
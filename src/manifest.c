@@ -0,0 +1,243 @@
+#include "manifest.h"
+#include "crc32c.h"
+#include "util.h"
+#include "mqlogerrno.h"
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define MANIFEST_FILE "MANIFEST"
+#define MANIFEST_TMP  "MANIFEST.tmp"
+
+#define CHECKPOINT_MAGIC 0x4b48434d  // "MCHK"
+#define LIST_MAGIC       0x5453494d  // "MIST"
+#define MANIFEST_VERSION 2
+
+enum { PATH_SIZE = 1024 };
+
+// Both blocks are checked independently: the checkpoint is
+// overwritten in place, a torn write only invalidates it.
+struct checkpoint_block {
+    uint32_t magic;
+    uint32_t crc;  // of the fields following it
+    uint64_t base_offset;
+    uint32_t index;
+    uint32_t data;
+    uint64_t reserved;
+};
+
+// Version 1 entries, without final offsets.
+struct entry_v1 {
+    uint64_t base_offset;
+    uint32_t size;
+    uint32_t flags;
+};
+
+struct list_block {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t count;
+    uint32_t crc;  // of the entries
+    uint32_t reserved0;
+    uint64_t reserved1;
+};
+
+static uint32_t checkpoint_crc(const struct checkpoint_block* block) {
+    const size_t offset = offsetof(struct checkpoint_block, base_offset);
+    return crc32c(0,
+                  (const unsigned char*)block + offset,
+                  sizeof(struct checkpoint_block) - offset);
+}
+
+static void init_checkpoint(struct checkpoint_block* block,
+                            const struct manifest_checkpoint* checkpoint) {
+    memset(block, 0, sizeof(struct checkpoint_block));
+    block->magic = CHECKPOINT_MAGIC;
+    block->base_offset = checkpoint->base_offset;
+    block->index = checkpoint->index;
+    block->data = checkpoint->data;
+    block->crc = checkpoint_crc(block);
+}
+
+static int manifest_path(char* path, const char* dir, const char* file) {
+    return append_file_to_dir(path, PATH_SIZE, dir, file) == -1 ? ELSOFLW : 0;
+}
+
+static int write_all(int fd, const void* buf, size_t size) {
+    const unsigned char* p = (const unsigned char*)buf;
+    while (size > 0) {
+        const ssize_t n = write(fd, p, size);
+        if (n <= 0) {
+            return ELFLEOP;
+        }
+        p += n;
+        size -= n;
+    }
+
+    return 0;
+}
+
+static int sync_directory(const char* dir) {
+    // The rename is only durable once the directory is.
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return ELFLEOP;
+    }
+
+    const int rc = fsync(fd);
+    close(fd);
+
+    return rc == 0 ? 0 : ELFLEOP;
+}
+
+int manifest_write(const char* dir,
+                   const struct manifest_entry* entries,
+                   size_t count,
+                   const struct manifest_checkpoint* checkpoint) {
+    char path[PATH_SIZE];
+    char tmp[PATH_SIZE];
+    if (manifest_path(path, dir, MANIFEST_FILE) != 0 ||
+        manifest_path(tmp, dir, MANIFEST_TMP) != 0) {
+        return ELSOFLW;
+    }
+
+    struct checkpoint_block cp;
+    init_checkpoint(&cp, checkpoint);
+
+    struct list_block list;
+    memset(&list, 0, sizeof(struct list_block));
+    list.magic = LIST_MAGIC;
+    list.version = MANIFEST_VERSION;
+    list.count = count;
+    list.crc = crc32c(0, entries, count * sizeof(struct manifest_entry));
+
+    int fd = open(tmp,
+                  O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (fd < 0) {
+        return ELFLEOP;
+    }
+
+    int rc = write_all(fd, &cp, sizeof(cp));
+    if (rc == 0) {
+        rc = write_all(fd, &list, sizeof(list));
+    }
+    if (rc == 0) {
+        rc = write_all(fd, entries, count * sizeof(struct manifest_entry));
+    }
+
+    // Synced before it replaces the previous manifest: a crash leaves
+    // either of them, complete.
+    if (rc == 0 && fsync(fd) != 0) {
+        rc = ELFLEOP;
+    }
+
+    close(fd);
+    if (rc != 0) {
+        unlink(tmp);
+        return rc;
+    }
+
+    if (rename(tmp, path) != 0) {
+        unlink(tmp);
+        return ELFLEOP;
+    }
+
+    return sync_directory(dir);
+}
+
+int manifest_read(const char* dir,
+                  struct manifest_entry** entries,
+                  size_t* count,
+                  struct manifest_checkpoint* checkpoint) {
+    char path[PATH_SIZE];
+    if (manifest_path(path, dir, MANIFEST_FILE) != 0) {
+        return ELSOFLW;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return ELMNFST;
+    }
+
+    struct checkpoint_block cp;
+    struct list_block list;
+    if (read(fd, &cp, sizeof(cp)) != sizeof(cp) ||
+        read(fd, &list, sizeof(list)) != sizeof(list) ||
+        list.magic != LIST_MAGIC ||
+        (list.version != 1 && list.version != MANIFEST_VERSION)) {
+        close(fd);
+        return ELMNFST;
+    }
+
+    // Version 1 entries are read at the end of the buffer, then
+    // moved to their place from the first one on.
+    const size_t size = list.count * sizeof(struct manifest_entry);
+    const size_t read_size = list.version == 1 ?
+        list.count * sizeof(struct entry_v1) : size;
+    struct manifest_entry* read_entries =
+        (struct manifest_entry*)malloc(size > 0 ? size : 1);
+    if (!read_entries) {
+        close(fd);
+        return ELALLC;
+    }
+
+    unsigned char* buffer = (unsigned char*)read_entries + size - read_size;
+    const ssize_t n = read(fd, buffer, read_size);
+    close(fd);
+    if (n < 0 ||
+        (size_t)n != read_size ||
+        crc32c(0, buffer, read_size) != list.crc) {
+        free(read_entries);
+        return ELMNFST;
+    }
+
+    if (list.version == 1) {
+        for (size_t i = 0; i < list.count; ++i) {
+            struct entry_v1 old;
+            memcpy(&old, buffer + i * sizeof(struct entry_v1), sizeof(old));
+            read_entries[i].base_offset = old.base_offset;
+            read_entries[i].size = old.size;
+            read_entries[i].flags = old.flags & MANIFEST_SEALED;
+            read_entries[i].index = 0;
+            read_entries[i].data = 0;
+        }
+    }
+
+    memset(checkpoint, 0, sizeof(struct manifest_checkpoint));
+    if (cp.magic == CHECKPOINT_MAGIC && checkpoint_crc(&cp) == cp.crc) {
+        checkpoint->base_offset = cp.base_offset;
+        checkpoint->index = cp.index;
+        checkpoint->data = cp.data;
+    }
+
+    *entries = read_entries;
+    *count = list.count;
+
+    return 0;
+}
+
+int manifest_checkpoint(const char* dir,
+                        const struct manifest_checkpoint* checkpoint) {
+    char path[PATH_SIZE];
+    if (manifest_path(path, dir, MANIFEST_FILE) != 0) {
+        return ELSOFLW;
+    }
+
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return ELMNFST;
+    }
+
+    struct checkpoint_block cp;
+    init_checkpoint(&cp, checkpoint);
+
+    const ssize_t n = pwrite(fd, &cp, sizeof(cp), 0);
+    close(fd);
+
+    return n == sizeof(cp) ? 0 : ELFLEOP;
+}
@@ -0,0 +1,46 @@
+#ifndef MQLOG_MANIFEST_H_
+#define MQLOG_MANIFEST_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * The manifest lists the segments of a log, so that opening it
+ * doesn't depend on the number of segments. It starts with a
+ * checkpoint: the last synced offsets of the tail segment. Sealed
+ * segments synced when it was written have their final offsets.
+ */
+
+#define MANIFEST_SEALED 0x1
+#define MANIFEST_FINAL  0x2  // sealed and synced at `index`, `data`
+
+struct manifest_entry {
+    uint64_t base_offset;
+    uint32_t size;
+    uint32_t flags;
+    uint32_t index;  // final relative offset, with MANIFEST_FINAL
+    uint32_t data;   // final physical offset
+};
+
+struct manifest_checkpoint {
+    uint64_t base_offset;  // tail segment
+    uint32_t index;        // synced relative offset
+    uint32_t data;         // synced physical offset
+};
+
+/* replaces the manifest atomically */
+int manifest_write(const char*,
+                   const struct manifest_entry*,
+                   size_t,
+                   const struct manifest_checkpoint*);
+
+/* entries are allocated, an invalid checkpoint is zeroed */
+int manifest_read(const char*,
+                  struct manifest_entry**,
+                  size_t*,
+                  struct manifest_checkpoint*);
+
+/* updates the checkpoint in place */
+int manifest_checkpoint(const char*, const struct manifest_checkpoint*);
+
+#endif
@@ -1,34 +1,206 @@
 #include "mqlog.h"
 #include "segment.h"
 #include "util.h"
-#include "mbptree.h"
+#include "futex.h"
+#include "worker.h"
+#include "manifest.h"
+#include "cassert.h"
 #include <string.h>
 #include <dirent.h>
 #include <assert.h>
 #include <errno.h>
 #include <pthread.h>
 #include <stdio.h>
+#include <limits.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
 
-enum { BRANCH_FACTOR = 7 };
 enum { MAX_DIR_SIZE = 1024 };
+enum { SPIN_LIMIT = 256 };           // pause iterations before parking
+enum { DEFAULT_PREPARE_THRESHOLD = 75 };  // %
+enum { DEFAULT_PREFAULT_WINDOW = 1048576 };  // 1MB
+enum { DEFAULT_INDEX_INTERVAL = 1 };
+enum { MAX_RECOVERY_THREADS = 16 };
+enum { DEFAULT_SYNC_INTERVAL_MS = 10 };
+enum { DEFAULT_SYNC_BYTES = 1048576 };  // 1MB
+enum { RECLAIM_RETRY_MS = 100 };  // expired segments still read
+enum { DEFAULT_POOLED_SEGMENTS = 4 };
+enum { MAX_READERS = 64 };
+enum { MAX_THREADS = 128 };  // implicit read sections
+enum { CACHE_LINE_SIZE = 64 };
 
-struct mqlog {
-    size_t          size;
-    unsigned int    flags;
-    char            dir[MAX_DIR_SIZE];
-    mbptree_t*      index;
-    pthread_mutex_t lock;
+// Background worker tasks
+enum {
+    TASK_PREPARE  = 0x1,
+    TASK_PREFAULT = 0x2,
+    TASK_SYNC     = 0x4,
+    TASK_RETAIN   = 0x8,
+    TASK_MANIFEST = 0x10
 };
 
-static int create_segment(segment_t** sgm, uint64_t base_offset, mqlog_t* lg) {
-    // TODO: this is not thread safe.
+// A read section, `epoch` is 0 outside of it. Readers have a cache
+// line each: entering and exiting a section doesn't contend. Threads
+// writing, or reading without a reader, get one implicitly.
+struct mqlog_reader {
+    volatile uint64_t epoch;  // global epoch when the section started
+    volatile uint32_t used;
+    mqlog_t*          lg;
+    unsigned char     padding[CACHE_LINE_SIZE - 2 * sizeof(uint64_t) -
+                              sizeof(mqlog_t*)];
+};
+
+CASSERT(sizeof(struct mqlog_reader) == CACHE_LINE_SIZE, mqlog_c)
+
+// Unmapped once no read section started before `epoch` is left.
+struct retired_mapping {
+    struct segment_mapping mapping;
+    uint64_t               epoch;
+};
+
+// Expired and unmapped, freed like a retired mapping once no read
+// out of a section is in progress either.
+struct retired_segment {
+    segment_t* sgm;
+    uint64_t   epoch;
+};
+
+// A sealed segment which can be unmapped. Producers may still be
+// writing to segments `written` in this process.
+struct mapping {
+    segment_t* sgm;
+    int        written;
+};
+
+// Segments readers search, sorted by base offset. A segment is
+// published by storing its entry, then incrementing `count`; expired
+// ones are dropped from the front. Both happen under the sequence of
+// the table. A full table is copied into a larger one, replaced tables
+// are kept until the log is closed.
+struct table_entry {
+    uint64_t   base_offset;
+    segment_t* sgm;
+};
+
+struct segment_table {
+    volatile size_t       count;
+    size_t                capacity;
+    struct segment_table* retired;  // table replaced by this one
+    struct table_entry    entries[];
+};
+
+// Expired, unmapped once not read, and once the frames claimed
+// before it was sealed are written. `pooled` holds its files when
+// they are recycled.
+struct condemned {
+    segment_t* sgm;
+    segment_t* pooled;
+    int        written;
+};
 
+// Reused once no read section started before `epoch` is left.
+struct pooled_segment {
+    segment_t* sgm;
+    uint64_t   epoch;
+};
+
+struct mqlog {
+    size_t              size;
+    unsigned int        flags;
+    char                dir[MAX_DIR_SIZE];
+    struct segment_table* volatile segments;  // searched by readers
+    volatile uint32_t   table_sequence;  // odd while the table changes
+    segment_t* volatile active;  // segment producers append to
+    pthread_mutex_t     lock;    // serializes segment rolls
+    pthread_mutex_t     sync_lock;  // protects the flush state
+    pthread_cond_t      flushed;    // signaled after every flush
+    int                 flushing;   // a flush is in progress
+    uint64_t            flushes_started;
+    uint64_t            flushes_done;
+    ssize_t             flush_result;     // of the last flush
+    volatile uint64_t   durable;          // frames below are synced
+    void              (*on_durable)(uint64_t, void*);
+    void*               on_durable_arg;
+    segment_t**         flush_segments;   // used by the flushing thread
+    size_t              flush_capacity;
+    volatile uint32_t   rolls;   // incremented after every roll attempt
+    volatile uint32_t   roll_waiters;
+    worker_t*           worker;
+    uint32_t            prepare_at;  // fill level triggering a prepare
+    segment_t* volatile prepared;    // spare segment, taken by rolls
+    uint32_t            prefault_window;
+    unsigned int        sync_policy;
+    unsigned int        sync_interval_ms;
+    size_t              sync_bytes;
+    uint64_t            synced_at;   // ms, last sync of the interval
+    volatile uint32_t   tasks;       // requested from the worker
+    uint32_t            index_interval;
+    pthread_mutex_t     map_lock;    // protects `mapped`
+    struct mapping*     mapped;      // sealed segments mapped
+    size_t              mapped_count;
+    size_t              mapped_capacity;
+    size_t              hand;        // clock hand, over `mapped`
+    size_t              max_mapped_segments;
+    size_t              max_mapped_bytes;
+    size_t              max_retained_segments;
+    size_t              max_retained_bytes;
+    unsigned int        max_segment_age_ms;
+    volatile uint64_t   low_water;  // offsets below are not retained
+    uint64_t            age_check_at;  // ms, the oldest segment expires
+    volatile uint32_t   unsectioned;   // threads in, without a section
+    struct condemned*   condemned;  // protected by `map_lock`
+    size_t              condemned_count;
+    size_t              condemned_capacity;
+    struct pooled_segment* pool;     // protected by `map_lock`
+    size_t              pool_count;
+    size_t              max_pooled_segments;
+    uint64_t            pooled_files;  // names pooled files
+    pthread_mutex_t     manifest_lock;
+    volatile uint64_t   epoch;       // advanced when a mapping retires
+    struct mqlog_reader* readers;    // MAX_READERS read sections
+    struct mqlog_reader* threads;    // MAX_THREADS implicit sections
+    pthread_key_t       thread_key;  // implicit section of the thread
+    int                 has_thread_key;
+    struct retired_mapping* retired; // protected by `map_lock`
+    size_t              retired_count;
+    size_t              retired_capacity;
+    struct retired_segment* expired; // protected by `map_lock`
+    size_t              expired_count;
+    size_t              expired_capacity;
+    segment_t**         dirty;   // sealed segments not synced yet
+    size_t              dirty_count;
+    size_t              dirty_capacity;
+    volatile uint32_t   published;     // incremented to wake up readers
+    volatile uint32_t   read_waiters;  // threads parked on `published`
+    volatile int        armed;         // the eventfd is signaled
+    int                 event_fd;
+};
+
+static unsigned int segment_flags(const mqlog_t* lg) {
     unsigned int flags = SGM_RDDRT;
     if ((lg->flags & MQLOG_RDCMT) == MQLOG_RDCMT) {
         flags = SGM_RDCMT;
     }
 
-    int rc = segment_open(sgm, lg->dir, base_offset, lg->size, flags);
+    if ((lg->flags & MQLOG_DIRECT) == MQLOG_DIRECT) {
+        flags |= SGM_PWRITE | SGM_DIRECT;
+    } else if ((lg->flags & MQLOG_PWRITE) == MQLOG_PWRITE) {
+        flags |= SGM_PWRITE;
+    }
+
+    return flags;
+}
+
+static int retaining(const mqlog_t* lg) {
+    return lg->max_retained_segments > 0 ||
+           lg->max_retained_bytes > 0 ||
+           lg->max_segment_age_ms > 0;
+}
+
+static int create_segment(segment_t** sgm, uint64_t base_offset, mqlog_t* lg) {
+    int rc = segment_open(sgm, lg->dir, base_offset, lg->size,
+                          segment_flags(lg), lg->index_interval);
     if (rc != 0) {
         return rc;
     }
@@ -36,268 +208,2555 @@ static int create_segment(segment_t** sgm, uint64_t base_offset, mqlog_t* lg) {
     return 0;
 }
 
-static ssize_t mqlog_trywrite(mqlog_t* lg, const void* buf, size_t size) {
-    // TODO: break this function up into small functions
+static segment_t* take_pooled(mqlog_t* lg);
 
-    // TODO: this is not thread safe.
-    segment_t* sgm = NULL;
-    unsigned int new_segment = 0;
-    mbptree_value_t value;
-    if (mbptree_last_value(lg->index, &value) == 0) {
-        sgm = (segment_t*)value.addr;
-    } else {
-        // This is the first segment
-        new_segment = 1;
-        int rc = create_segment(&sgm, 0, lg);
-        if (rc != 0) {
-            return rc;
+static void prepare_segment(mqlog_t* lg) {
+    // Only the worker sets `prepared`, rolls only take it.
+    if (lg->prepared) {
+        return;
+    }
+
+    // On failure the next write past the threshold tries again,
+    // rolls fall back to creating the segment themselves.
+    segment_t* sgm = take_pooled(lg);
+    if (sgm ||
+        segment_prepare(&sgm, lg->dir, lg->size, segment_flags(lg),
+                        lg->index_interval) == 0) {
+        if (lg->prefault_window > 0) {
+            // The first pages written after the roll.
+            segment_prefault(sgm, lg->prefault_window);
         }
+
+        __sync_synchronize();
+        lg->prepared = sgm;
     }
+}
 
-    // TODO Handle ELLOCK
-    ssize_t written = segment_write(sgm, buf, size);
-    if (written == ELEOS && new_segment) {
-        // this means the the new frame is greater than the
-        // entire segment
-        segment_close(sgm);
-        return ELNOWCP;
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int sync_due(mqlog_t* lg) {
+    if (lg->sync_policy != MQLOG_SYNC_INTERVAL) {
+        return 0;
     }
 
-    if (written == ELEOS) {
-        // segment has no capacity left
-        assert(new_segment == 0);
-        new_segment = 1;
-        const uint64_t new_base_offset = segment_write_offset(sgm);
-        int rc = create_segment(&sgm, new_base_offset, lg);
-        if (rc != 0) {
-            // TODO add return code
-            return rc;
-        }
+    const uint64_t now = now_ms();
+    if (now - lg->synced_at < lg->sync_interval_ms) {
+        return 0;
+    }
 
-        // TODO Handle ELLOCK
-        written = segment_write(sgm, buf, size);
-        if (written == ELEOS) {
-            // Only attempt to write twice.
-            // This point is reached if a payload greater than
-            // the segment size is being inserted.
-            // Handling payloads greater than the segment size
-            // is currently not supported.
-            segment_close(sgm);
-            return ELNOWCP;
+    lg->synced_at = now;
+    return 1;
+}
+
+static void expire_segments(mqlog_t* lg);
+static int write_manifest(mqlog_t* lg);
+
+static void run_tasks(void* arg) {
+    mqlog_t* lg = (mqlog_t*)arg;
+
+    const uint32_t tasks = __sync_fetch_and_and(&lg->tasks, 0);
+    if (tasks & TASK_PREPARE) {
+        prepare_segment(lg);
+    }
+
+    if (tasks & TASK_PREFAULT) {
+        // Pinned like in `flush_log`: it may be evicted meanwhile.
+        segment_t* sgm = lg->active;
+        if (sgm && segment_acquire(sgm) == 0) {
+            segment_prefault(sgm, lg->prefault_window);
+            segment_release(sgm);
         }
     }
 
-    if (new_segment) {
-        const uint64_t base_offset = segment_base_offset(sgm);
-        int rc = mbptree_append(lg->index, base_offset, addr(sgm));
-        if (rc == ELIDXPC) {
-            segment_close(sgm);
-            return rc;
-        } else if (rc != 0) {
-            segment_close(sgm);
-            return ELIDXOP;
+    // The worker may wake up more often than the sync interval.
+    if ((tasks & TASK_SYNC) || sync_due(lg)) {
+        mqlog_sync(lg);
+    }
+
+    if (tasks & TASK_MANIFEST) {
+        write_manifest(lg);
+    }
+
+    // Segments age: checked again once the oldest one expires, or
+    // soon if expired segments are still read.
+    const uint64_t now = now_ms();
+    if ((tasks & TASK_RETAIN) ||
+        (lg->age_check_at > 0 && now >= lg->age_check_at) ||
+        lg->condemned_count > 0 ||
+        lg->expired_count > 0) {
+        expire_segments(lg);
+    }
+
+    if (lg->condemned_count > 0 || lg->expired_count > 0) {
+        worker_schedule(lg->worker, RECLAIM_RETRY_MS);
+    } else if (lg->age_check_at > 0) {
+        const uint64_t delay = lg->age_check_at > now ?
+            lg->age_check_at - now : 0;
+        worker_schedule(lg->worker, (unsigned int)min(delay, UINT_MAX));
+    }
+}
+
+static void request_task(mqlog_t* lg, uint32_t task) {
+    if (!(lg->tasks & task) &&
+        !(__sync_fetch_and_or(&lg->tasks, task) & task)) {
+        worker_notify(lg->worker);
+    }
+}
+
+static void on_write(mqlog_t* lg, const segment_t* sgm) {
+    if (!lg->worker) {
+        return;
+    }
+
+    const uint32_t data_offset = segment_data_offset(sgm);
+    if (lg->prepare_at > 0 &&
+        data_offset >= lg->prepare_at &&
+        !lg->prepared) {
+        request_task(lg, TASK_PREPARE);
+    }
+
+    // Refill the window when half of it has been consumed.
+    if (lg->prefault_window > 0 &&
+        (uint64_t)data_offset + lg->prefault_window / 2 >
+            segment_faulted(sgm) &&
+        segment_faulted(sgm) < lg->size) {
+        request_task(lg, TASK_PREFAULT);
+    }
+
+    if (lg->sync_policy == MQLOG_SYNC_BYTES) {
+        uint32_t index = 0;
+        uint32_t data = 0;
+        segment_synced(sgm, &index, &data);
+        if (data_offset - data >= lg->sync_bytes) {
+            request_task(lg, TASK_SYNC);
         }
     }
+}
 
-    return written;
+static void notify_readers(mqlog_t* lg) {
+    // Orders the frame flag before the loads: either a reader
+    // registered sees the frame, or the producer sees the reader.
+    __sync_synchronize();
+
+    if (lg->read_waiters) {
+        __sync_add_and_fetch(&lg->published, 1);
+        futex_wake(&lg->published, INT_MAX);
+    }
+
+    if (lg->armed && __sync_lock_test_and_set(&lg->armed, 0)) {
+        const uint64_t event = 1;
+        if (write(lg->event_fd, &event, sizeof(event)) != sizeof(event)) {
+            // The counter is full: it is readable already.
+        }
+    }
 }
 
-static ssize_t mqlog_tryread(mqlog_t* lg,
-                             uint64_t offset,
-                             struct frame* fr) {
-    // Find the segment the offset is located.
-    // This can return `prev` or `curr` segment.
-    int rc = pthread_mutex_trylock(&lg->lock);
-    if (rc == EBUSY) {
-        return ELLOCK;
+static int next_spare(segment_t** sgm, uint64_t base_offset, mqlog_t* lg) {
+    segment_t* spare = __sync_lock_test_and_set(&lg->prepared, NULL);
+    if (spare) {
+        // The roll only renames the files of the spare segment.
+        if (segment_activate(spare, lg->dir, base_offset) == 0) {
+            *sgm = spare;
+            return 0;
+        }
+
+        segment_delete(spare);
     }
-    if (rc != 0) {
-        return errno == EBUSY ? ELLOCK : ELLCKOP;
+
+    // The files of an expired segment, cleared.
+    spare = take_pooled(lg);
+    if (spare) {
+        if (segment_activate(spare, lg->dir, base_offset) == 0) {
+            *sgm = spare;
+            return 0;
+        }
+
+        segment_delete(spare);
     }
 
-    mbptree_leaf_iterator_t* iterator;
-    rc = mbptree_leaf_floor(lg->index, offset, &iterator);
-    if (rc != 0) {
-        return rc;
+    return create_segment(sgm, base_offset, lg);
+}
+
+static int over_budget(const mqlog_t* lg, size_t incoming) {
+    const size_t count = lg->mapped_count + incoming;
+    if (lg->max_mapped_segments > 0 && count > lg->max_mapped_segments) {
+        return 1;
     }
 
-    if (!mbptree_leaf_iterator_valid(iterator)) {
-        free(iterator);
-        if (pthread_mutex_unlock(&lg->lock) != 0) {
-            return ELLCKOP;
+    return lg->max_mapped_bytes > 0 && count * lg->size > lg->max_mapped_bytes;
+}
+
+static void retire_mapping(mqlog_t* lg, const struct segment_mapping* m) {
+    // Called with `map_lock` held.
+    if (lg->retired_count == lg->retired_capacity) {
+        const size_t capacity = max(2 * lg->retired_capacity, 16);
+        struct retired_mapping* retired = (struct retired_mapping*)realloc(
+            lg->retired, capacity * sizeof(struct retired_mapping));
+        if (!retired) {
+            // Leaked: readers may still use it.
+            return;
         }
-        return ELNORD;
+        lg->retired = retired;
+        lg->retired_capacity = capacity;
     }
 
-    if (pthread_mutex_unlock(&lg->lock) != 0) {
-        return ELLCKOP;
+    // Sections started from now on can't reach the mapping anymore.
+    struct retired_mapping* r = &lg->retired[lg->retired_count++];
+    r->mapping = *m;
+    r->epoch = __sync_fetch_and_add(&lg->epoch, 1);
+}
+
+static uint64_t oldest_section(const mqlog_t* lg) {
+    // Implicit sections follow the readers.
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < MAX_READERS + MAX_THREADS; ++i) {
+        const uint64_t epoch = lg->readers[i].epoch;
+        if (epoch != 0 && epoch < oldest) {
+            oldest = epoch;
+        }
     }
 
-    mbptree_value_t value = mbptree_leaf_iterator_value(iterator);
-    const segment_t* sgm = (const segment_t*)value.addr;
+    return oldest;
+}
 
-    free(iterator);
+static void reclaim_mappings(mqlog_t* lg) {
+    // Called with `map_lock` held.
+    if (lg->retired_count == 0) {
+        return;
+    }
 
-    uint64_t base_offset = segment_base_offset(sgm);
-    uint64_t relative_offset = offset - base_offset;
+    // A section started at the epoch of a mapping, or before,
+    // may still read from it. So may threads without a section.
+    __sync_synchronize();
+    if (lg->unsectioned > 0) {
+        return;
+    }
 
-    return segment_read(sgm, relative_offset, fr);
+    const uint64_t oldest = oldest_section(lg);
+    size_t kept = 0;
+    for (size_t i = 0; i < lg->retired_count; ++i) {
+        if (lg->retired[i].epoch < oldest) {
+            segment_release_mapping(&lg->retired[i].mapping);
+        } else {
+            lg->retired[kept++] = lg->retired[i];
+        }
+    }
+    lg->retired_count = kept;
 }
 
-static int load_segments(mqlog_t* lg) {
-    DIR* d = opendir(lg->dir);
-    if (d) {
-        struct dirent *dir;
-        while ((dir = readdir(d)) != NULL) {
-            // TODO: don't hardcode `.log`
-            if (has_suffix(dir->d_name, ".log")) {
-                char str[MAX_DIR_SIZE];
-                snprintf(str, MAX_DIR_SIZE, "%s/%s", lg->dir, dir->d_name);
-
-                ssize_t size = file_size(str);
-                if (size == -1) {
-                    return ELLDSGM;
-                }
+static void retire_segment(mqlog_t* lg, segment_t* sgm) {
+    // Called with `map_lock` held.
+    if (lg->expired_count == lg->expired_capacity) {
+        const size_t capacity = max(2 * lg->expired_capacity, 16);
+        struct retired_segment* expired = (struct retired_segment*)realloc(
+            lg->expired, capacity * sizeof(struct retired_segment));
+        if (!expired) {
+            // Leaked: readers may still use it.
+            return;
+        }
+        lg->expired = expired;
+        lg->expired_capacity = capacity;
+    }
+
+    // Readers starting from now on don't find the segment anymore.
+    struct retired_segment* r = &lg->expired[lg->expired_count++];
+    r->sgm = sgm;
+    r->epoch = __sync_fetch_and_add(&lg->epoch, 1);
+}
 
-                snprintf(str, MAX_DIR_SIZE, "%s", dir->d_name);
+static void reclaim_segments(mqlog_t* lg) {
+    // Called with `map_lock` held. Reads out of a section have no
+    // epoch: none may be in progress since the segments were retired.
+    __sync_synchronize();
+    if (lg->expired_count == 0 || lg->unsectioned > 0) {
+        return;
+    }
 
-                uint64_t offset = strtoll(str, NULL, 10);
+    const uint64_t oldest = oldest_section(lg);
+    size_t kept = 0;
+    for (size_t i = 0; i < lg->expired_count; ++i) {
+        if (lg->expired[i].epoch < oldest) {
+            // Unmapped: only the segment itself is freed.
+            segment_close(lg->expired[i].sgm);
+        } else {
+            lg->expired[kept++] = lg->expired[i];
+        }
+    }
+    lg->expired_count = kept;
+}
 
-                segment_t* sgm = 0;
-                int rc = segment_open(&sgm, lg->dir, offset, size, lg->flags);
-                if (rc != 0) {
-                    return ELLDSGM;
-                }
+static void release_thread(void* section) {
+    // The thread exits, out of any section.
+    ((struct mqlog_reader*)section)->used = 0;
+}
 
-                rc = mbptree_append(lg->index, offset, addr(sgm));
-                if (rc == ELIDXPC) {
-                    segment_close(sgm);
-                    return rc;
-                } else if (rc != 0) {
-                    segment_close(sgm);
-                    return ELLDSGM;
-                }
+static struct mqlog_reader* thread_section(mqlog_t* lg) {
+    // Claimed on first use, kept until the thread exits.
+    struct mqlog_reader* section =
+        (struct mqlog_reader*)pthread_getspecific(lg->thread_key);
+    if (section) {
+        return section;
+    }
+
+    for (size_t i = 0; i < MAX_THREADS; ++i) {
+        struct mqlog_reader* r = &lg->threads[i];
+        if (!r->used && __sync_bool_compare_and_swap(&r->used, 0, 1)) {
+            r->epoch = 0;
+            r->lg = lg;
+            if (pthread_setspecific(lg->thread_key, r) != 0) {
+                r->used = 0;
+                return NULL;
             }
+            return r;
         }
     }
-    closedir(d);
 
-    return 0;
+    return NULL;
 }
 
-int mqlog_open(mqlog_t** lg_ptr,
-             const char* dir,
-             size_t size,
-             unsigned int flags) {
+static struct mqlog_reader* enter_implicit(mqlog_t* lg) {
+    // Segments found from now on, their struct and their mapping,
+    // are not freed before the section is left. Only retention
+    // frees segments while the log is open. Threads without a
+    // section are counted instead.
+    if (!retaining(lg)) {
+        return NULL;
+    }
 
-    // Size has to be a multiple of page size.
-    if (size % pagesize() != 0) {
-        return ELNOPGM;
+    struct mqlog_reader* section = thread_section(lg);
+    if (section) {
+        mqlog_enter(section);
+    } else {
+        __sync_add_and_fetch(&lg->unsectioned, 1);
     }
 
-    if (ensure_directory(dir) != 0) {
-        return ELLGDIR;
+    return section;
+}
+
+static void exit_implicit(mqlog_t* lg, struct mqlog_reader* section) {
+    if (section) {
+        mqlog_exit(section);
+    } else if (retaining(lg)) {
+        __sync_sub_and_fetch(&lg->unsectioned, 1);
     }
+}
 
-    struct mqlog* lg = (struct mqlog*)malloc(sizeof(struct mqlog));
-    if (!lg) {
-        return ELALLC;
+static void evict_segments(mqlog_t* lg, size_t incoming) {
+    // Clock algorithm: segments read since the last sweep get a second
+    // chance. Segments being read or written are skipped, the budget
+    // is exceeded if none can be unmapped.
+    size_t steps = 2 * lg->mapped_count;
+    while (lg->mapped_count > 0 && steps-- > 0 && over_budget(lg, incoming)) {
+        if (lg->hand >= lg->mapped_count) {
+            lg->hand = 0;
+        }
+
+        struct mapping* m = &lg->mapped[lg->hand];
+        struct segment_mapping mapping;
+        if (segment_referenced(m->sgm) ||
+            (m->written && !segment_quiescent(m->sgm)) ||
+            segment_detach(m->sgm, 1, &mapping) == ELLOCK) {
+            ++lg->hand;
+            continue;
+        }
+
+        retire_mapping(lg, &mapping);
+        *m = lg->mapped[--lg->mapped_count];
     }
 
-    // Initialize segment struct.
-    memset(lg, 0, sizeof(struct mqlog));
-    lg->size = size;
-    snprintf(lg->dir, MAX_DIR_SIZE, "%s", dir);
+    reclaim_mappings(lg);
+}
 
-    lg->flags = flags;
+static int track_segment(mqlog_t* lg, segment_t* sgm, int written) {
+    // Called with `map_lock` held.
+    if (lg->mapped_count == lg->mapped_capacity) {
+        const size_t capacity = max(2 * lg->mapped_capacity, 16);
+        struct mapping* mapped = (struct mapping*)realloc(
+            lg->mapped, capacity * sizeof(struct mapping));
+        if (!mapped) {
+            // The segment stays mapped until the log is closed.
+            return ELALLC;
+        }
+        lg->mapped = mapped;
+        lg->mapped_capacity = capacity;
+    }
 
-    lg->index = mbptree_init(BRANCH_FACTOR);
-    if (!lg->index) {
-        mqlog_close(lg);
-        return ELIDXCR;
+    const struct mapping m = {
+        .sgm = sgm,
+        .written = written
+    };
+    lg->mapped[lg->mapped_count++] = m;
+
+    return 0;
+}
+
+static int add_dirty(mqlog_t* lg, segment_t* sgm) {
+    // Called with `map_lock` held.
+    if (lg->dirty_count == lg->dirty_capacity) {
+        const size_t capacity = max(2 * lg->dirty_capacity, 16);
+        segment_t** dirty = (segment_t**)realloc(
+            lg->dirty, capacity * sizeof(segment_t*));
+        if (!dirty) {
+            return ELALLC;
+        }
+        lg->dirty = dirty;
+        lg->dirty_capacity = capacity;
     }
 
-    if (pthread_mutex_init(&lg->lock, NULL)) {
-        mqlog_close(lg);
+    lg->dirty[lg->dirty_count++] = sgm;
+
+    return 0;
+}
+
+static void seal_segment(mqlog_t* lg, segment_t* sgm) {
+    // `sgm` is about to be replaced by a new active segment: a flush
+    // reading the new one finds `sgm` in the dirty segments.
+    pthread_mutex_lock(&lg->map_lock);
+    if (add_dirty(lg, sgm) != 0) {
+        // Frames written from now on are synced when unmapped.
+        segment_sync(sgm);
+    }
+    track_segment(lg, sgm, 1);
+    evict_segments(lg, 0);
+    pthread_mutex_unlock(&lg->map_lock);
+}
+
+static int map_segment(mqlog_t* lg, segment_t* sgm) {
+    if (pthread_mutex_lock(&lg->map_lock) != 0) {
         return ELLCKOP;
     }
 
-    int rc = load_segments(lg);
-    if (rc != 0) {
-        mqlog_close(lg);
-        return  rc;
+    // Expired segments are not mapped again, their files may be gone.
+    int rc = 0;
+    if (segment_base_offset(sgm) < lg->low_water) {
+        rc = ELOSLOW;
+    } else if (!segment_mapped(sgm)) {
+        evict_segments(lg, 1);
+        rc = segment_map(sgm);
+        if (rc == 0) {
+            track_segment(lg, sgm, 0);
+        }
     }
 
-    *lg_ptr = lg;
+    if (pthread_mutex_unlock(&lg->map_lock) != 0) {
+        return ELLCKOP;
+    }
 
-    return 0;
+    return rc;
 }
 
-int mqlog_close(mqlog_t* lg) {
-    int errors = 0;
+static int write_manifest(mqlog_t* lg) {
+    // Written by rolls and by the retention task.
+    if (pthread_mutex_lock(&lg->manifest_lock) != 0) {
+        return ELLCKOP;
+    }
 
-    if (lg->index) {
-        mbptree_leaf_iterator_t* iterator;
-        int rc = mbptree_leaf_first(lg->index, &iterator);
-        if (rc != 0) {
-            return rc;
+    // The table is read like readers do: the copy is made again
+    // if the table changed.
+    struct manifest_entry* entries = NULL;
+    size_t count = 0;
+    for (;;) {
+        const uint32_t sequence = lg->table_sequence;
+        if (sequence & 1) {
+            cpu_relax();
+            continue;
         }
+        __sync_synchronize();
 
-        for (; mbptree_leaf_iterator_valid(iterator);
-               iterator = mbptree_leaf_iterator_next(iterator)) {
+        const struct segment_table* table = lg->segments;
+        count = table ? table->count : 0;
+        entries = (struct manifest_entry*)malloc(
+            max(count, 1) * sizeof(struct manifest_entry));
+        if (!entries) {
+            pthread_mutex_unlock(&lg->manifest_lock);
+            return ELALLC;
+        }
 
-            mbptree_value_t value = mbptree_leaf_iterator_value(iterator);
-            segment_t* sgm = (segment_t*)value.addr;
-            if (segment_close(sgm) != 0) {
-                ++errors;
+        for (size_t i = 0; i < count; ++i) {
+            const segment_t* sgm = table->entries[i].sgm;
+
+            // Only the tail segment is not sealed. Sealed segments
+            // synced are mapped again without searching their index.
+            struct manifest_entry* entry = &entries[i];
+            entry->base_offset = segment_base_offset(sgm);
+            entry->size = segment_size(sgm);
+            entry->flags = sgm == lg->active ? 0 : MANIFEST_SEALED;
+            entry->index = 0;
+            entry->data = 0;
+            if (entry->flags && segment_durable(sgm)) {
+                entry->flags |= MANIFEST_FINAL;
+                segment_synced(sgm, &entry->index, &entry->data);
             }
         }
 
-        free(iterator);
-
-        if (mbptree_free(lg->index) != 0) {
-            ++errors;
+        __sync_synchronize();
+        if (lg->table_sequence == sequence) {
+            break;
         }
+        free(entries);
     }
 
-    pthread_mutex_destroy(&lg->lock);
+    struct manifest_checkpoint checkpoint = {
+        .base_offset = 0,
+        .index = 0,
+        .data = 0
+    };
+    if (lg->active) {
+        checkpoint.base_offset = segment_base_offset(lg->active);
+        segment_synced(lg->active, &checkpoint.index, &checkpoint.data);
+    }
 
-    free(lg);
-    return errors == 0 ? 0 : ELLGCLS;
+    const int rc = manifest_write(lg->dir, entries, count, &checkpoint);
+    free(entries);
+    pthread_mutex_unlock(&lg->manifest_lock);
+
+    return rc;
 }
 
-ssize_t mqlog_write(mqlog_t* lg, const void* buf, size_t size) {
-    if (size == 0) {
+static void lock_table(mqlog_t* lg) {
+    // Rolls append to the table, the worker expires segments. Readers
+    // search the table again if the sequence changed meanwhile.
+    for (;;) {
+        const uint32_t sequence = lg->table_sequence;
+        if (!(sequence & 1) &&
+            __sync_bool_compare_and_swap(&lg->table_sequence,
+                                         sequence, sequence + 1)) {
+            return;
+        }
+        cpu_relax();
+    }
+}
+
+static void unlock_table(mqlog_t* lg) {
+    // Full barrier: the changes are visible before the even sequence.
+    __sync_add_and_fetch(&lg->table_sequence, 1);
+}
+
+static int reserve_table(mqlog_t* lg) {
+    struct segment_table* table = lg->segments;
+    if (table && table->count < table->capacity) {
         return 0;
     }
 
-    int rc = pthread_mutex_trylock(&lg->lock);
-    if (rc == EBUSY) {
-        return ELLOCK;
+    const size_t count = table ? table->count : 0;
+    const size_t capacity = max(2 * count, 64);
+    struct segment_table* grown = (struct segment_table*)malloc(
+        sizeof(struct segment_table) + capacity * sizeof(struct table_entry));
+    if (!grown) {
+        return ELALLC;
     }
-    if (rc != 0) {
-        return errno == EBUSY ? ELLOCK : ELLCKOP;
+
+    if (table) {
+        memcpy(grown->entries, table->entries,
+               count * sizeof(struct table_entry));
     }
+    grown->count = count;
+    grown->capacity = capacity;
+    grown->retired = table;
 
-    ssize_t written = mqlog_trywrite(lg, buf, size);
+    // Readers still searching `table` find the same entries.
+    __sync_synchronize();
+    lg->segments = grown;
 
-    if (pthread_mutex_unlock(&lg->lock) != 0) {
-        return ELLCKOP;
+    return 0;
+}
+
+static int index_segment(mqlog_t* lg, segment_t* sgm) {
+    lock_table(lg);
+    if (reserve_table(lg) != 0) {
+        unlock_table(lg);
+        return ELIDXOP;
     }
 
-    return written;
+    const uint64_t base_offset = segment_base_offset(sgm);
+    struct segment_table* table = lg->segments;
+    const struct table_entry entry = {
+        .base_offset = base_offset,
+        .sgm = sgm
+    };
+    table->entries[table->count] = entry;
+
+    __sync_synchronize();
+    ++table->count;
+    unlock_table(lg);
+
+    return 0;
 }
 
-ssize_t mqlog_read(mqlog_t* lg, uint64_t offset, struct frame* fr) {
-    return mqlog_tryread(lg, offset, fr);
+static size_t upper_bound(const struct segment_table* table,
+                          uint64_t offset) {
+    // Number of segments with a base offset lower or equal to `offset`.
+    size_t lo = 0;
+    size_t hi = table->count;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        if (table->entries[mid].base_offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
 }
 
-ssize_t mqlog_sync(const mqlog_t* lg) {
-    // TODO this only syncs the last segment
-    mbptree_value_t value;
-    if (mbptree_last_value(lg->index, &value) == 0) {
-        return segment_sync((segment_t*)value.addr);
+static segment_t* find_segment(const mqlog_t* lg, uint64_t offset) {
+    // Consumers mostly read the segment producers append to.
+    segment_t* active = lg->active;
+    if (active && offset >= segment_base_offset(active)) {
+        return active;
     }
 
-    return 0;
+    // The last segment with a base offset lower or equal to `offset`,
+    // unless expired.
+    for (;;) {
+        const uint32_t sequence = lg->table_sequence;
+        if (sequence & 1) {
+            // A roll or the retention task is changing the table.
+            cpu_relax();
+            continue;
+        }
+        __sync_synchronize();
+
+        segment_t* sgm = NULL;
+        const struct segment_table* table = lg->segments;
+        if (table) {
+            const size_t i = upper_bound(table, offset);
+            sgm = i > 0 ? table->entries[i - 1].sgm : NULL;
+        }
+
+        __sync_synchronize();
+        if (lg->table_sequence == sequence) {
+            return sgm;
+        }
+    }
+}
+
+static segment_t* following_segment(const mqlog_t* lg, const segment_t* sgm) {
+    const uint64_t base_offset = segment_base_offset(sgm);
+    for (;;) {
+        const uint32_t sequence = lg->table_sequence;
+        if (sequence & 1) {
+            cpu_relax();
+            continue;
+        }
+        __sync_synchronize();
+
+        segment_t* next = NULL;
+        const struct segment_table* table = lg->segments;
+        if (table) {
+            const size_t i = upper_bound(table, base_offset);
+            next = i < table->count ? table->entries[i].sgm : NULL;
+        }
+
+        __sync_synchronize();
+        if (lg->table_sequence == sequence) {
+            return next;
+        }
+    }
+}
+
+static void publish_segment(mqlog_t* lg, segment_t* sgm) {
+    // `sgm` has to be fully initialised before producers can see it.
+    __sync_synchronize();
+    lg->active = sgm;
+}
+
+static int roll_segment(mqlog_t* lg, segment_t* full) {
+    // Rolling is the only part of the write path that is serialized.
+    // Producers that lose the race get `ELLOCK` and retry against
+    // the segment published by the winner.
+    int rc = pthread_mutex_trylock(&lg->lock);
+    if (rc == EBUSY) {
+        return ELLOCK;
+    }
+    if (rc != 0) {
+        return ELLCKOP;
+    }
+
+    // Another producer may have rolled `full` already.
+    int rolled = 0;
+    if (lg->active == full) {
+        // `full` is sealed: its write offset can't move anymore.
+        const uint64_t base_offset = full ? segment_write_offset(full) : 0;
+
+        segment_t* sgm = NULL;
+        rc = next_spare(&sgm, base_offset, lg);
+        if (rc == 0) {
+            rc = index_segment(lg, sgm);
+            if (rc == 0) {
+                if (full) {
+                    seal_segment(lg, full);
+                }
+                publish_segment(lg, sgm);
+                rolled = 1;
+
+                if (full && retaining(lg)) {
+                    request_task(lg, TASK_RETAIN);
+                }
+            } else {
+                segment_close(sgm);
+            }
+        }
+    }
+
+    if (pthread_mutex_unlock(&lg->lock) != 0) {
+        return ELLCKOP;
+    }
+
+    // Wake up blocked producers, whatever the outcome of the roll:
+    // if it failed one of them will try again.
+    __sync_add_and_fetch(&lg->rolls, 1);
+    if (lg->roll_waiters) {
+        futex_wake(&lg->rolls, INT_MAX);
+    }
+
+    // Outside of the roll: the manifest is synced. Segments missing
+    // from it are found at open time, the roll doesn't fail if it
+    // can't be written.
+    if (rolled) {
+        if (lg->worker) {
+            request_task(lg, TASK_MANIFEST);
+        } else {
+            write_manifest(lg);
+        }
+    }
+
+    return rc;
+}
+
+static void wait_roll(mqlog_t* lg, uint32_t rolls) {
+    // Rolls are short: spin first, then park.
+    for (int i = 0; i < SPIN_LIMIT; ++i) {
+        if (lg->rolls != rolls) {
+            return;
+        }
+        cpu_relax();
+    }
+
+    // Only rolls take the lock, and every attempt wakes up the
+    // producers parked: no timeout is needed. A roll ending before
+    // the wait makes it return straight away.
+    __sync_add_and_fetch(&lg->roll_waiters, 1);
+    futex_wait(&lg->rolls, rolls, NULL);
+    __sync_sub_and_fetch(&lg->roll_waiters, 1);
+}
+
+static int next_segment(mqlog_t* lg, segment_t* full, uint32_t rolls) {
+    // The segment has no capacity left, or this is the first one.
+    const int rc = roll_segment(lg, full);
+    if (rc == ELLOCK && (lg->flags & MQLOG_WRBLK) == MQLOG_WRBLK) {
+        wait_roll(lg, rolls);
+        return 0;
+    }
+
+    return rc;
+}
+
+static int pinned(const mqlog_t* lg) {
+    // Without a mapping budget or retention, segments are never
+    // unmapped: they don't need to be pinned.
+    return lg->max_mapped_segments > 0 ||
+           lg->max_mapped_bytes > 0 ||
+           retaining(lg);
+}
+
+static int pin_segment(mqlog_t* lg, segment_t* sgm) {
+    int rc = 0;
+    if (pinned(lg)) {
+        // Sealed segments are mapped on first read.
+        while ((rc = segment_acquire(sgm)) == ELUNMAP) {
+            rc = map_segment(lg, sgm);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    } else if (!segment_mapped(sgm)) {
+        rc = map_segment(lg, sgm);
+    }
+
+    return rc;
+}
+
+static void unpin_segment(mqlog_t* lg, segment_t* sgm) {
+    if (pinned(lg)) {
+        segment_release(sgm);
+    }
+}
+
+static ssize_t missing_segment(const mqlog_t* lg, uint64_t offset) {
+    return offset < lg->low_water ? ELOSLOW : ELNORD;
+}
+
+static ssize_t check_lost(const mqlog_t* lg,
+                          const segment_t* sgm,
+                          uint64_t offset) {
+    // A recovery seals segments after their last valid frame: the
+    // offsets up to the next segment don't exist anymore. The next
+    // segment is read first: once rolled, the write offset of `sgm`
+    // is final. The active one may have been rolled several times
+    // since `sgm` was found.
+    const segment_t* next = following_segment(lg, sgm);
+    __sync_synchronize();
+    if (next &&
+        offset >= segment_write_offset(sgm) &&
+        offset < segment_base_offset(next)) {
+        return ELLOST;
+    }
+
+    return ELNORD;
+}
+
+static ssize_t read_segment(mqlog_t* lg,
+                            uint64_t offset,
+                            struct frame* fr) {
+    // Find the segment the offset is located.
+    // This can return `prev` or `curr` segment.
+    segment_t* sgm = find_segment(lg, offset);
+    if (!sgm) {
+        return missing_segment(lg, offset);
+    }
+
+    int rc = pin_segment(lg, sgm);
+    if (rc != 0) {
+        return rc;
+    }
+
+    uint64_t base_offset = segment_base_offset(sgm);
+    uint64_t relative_offset = offset - base_offset;
+
+    const ssize_t read = segment_read(sgm, relative_offset, fr);
+    unpin_segment(lg, sgm);
+
+    return read == ELNORD ? check_lost(lg, sgm, offset) : read;
+}
+
+static ssize_t mqlog_tryread(mqlog_t* lg,
+                             uint64_t offset,
+                             struct frame* fr) {
+    // Out of a read section, the thread's own keeps expired segments.
+    struct mqlog_reader* section = enter_implicit(lg);
+    const ssize_t read = read_segment(lg, offset, fr);
+    exit_implicit(lg, section);
+
+    return read;
+}
+
+static ssize_t readv_segment(mqlog_t* lg,
+                             uint64_t offset,
+                             struct frame* frames,
+                             size_t max,
+                             size_t max_bytes) {
+
+    segment_t* sgm = find_segment(lg, offset);
+    if (!sgm) {
+        return missing_segment(lg, offset);
+    }
+
+    int rc = pin_segment(lg, sgm);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Frames are read up to the end of the segment.
+    const uint64_t relative_offset = offset - segment_base_offset(sgm);
+    const ssize_t read = segment_readv(sgm, relative_offset, frames,
+                                       max, max_bytes);
+    unpin_segment(lg, sgm);
+
+    if (read == ELEOS || read == ELNORD) {
+        return check_lost(lg, sgm, offset);
+    }
+
+    return read;
+}
+
+static ssize_t mqlog_tryreadv(mqlog_t* lg,
+                              uint64_t offset,
+                              struct frame* frames,
+                              size_t max,
+                              size_t max_bytes) {
+    if (max == 0) {
+        return ELNORD;
+    }
+
+    struct mqlog_reader* section = enter_implicit(lg);
+    const ssize_t read = readv_segment(lg, offset, frames, max, max_bytes);
+    exit_implicit(lg, section);
+
+    return read;
+}
+
+static int compare_offsets(const void* a, const void* b) {
+    const uint64_t x = *(const uint64_t*)a;
+    const uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int list_segments(mqlog_t* lg, uint64_t** offsets, size_t* count) {
+    *offsets = NULL;
+    *count = 0;
+
+    DIR* d = opendir(lg->dir);
+    if (!d) {
+        return 0;
+    }
+
+    size_t capacity = 0;
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+        // TODO: don't hardcode `.log`
+        if (!has_suffix(dir->d_name, ".log")) {
+            continue;
+        }
+
+        if (*count == capacity) {
+            capacity = max(2 * capacity, 64);
+            uint64_t* grown = (uint64_t*)realloc(*offsets,
+                                                 capacity * sizeof(uint64_t));
+            if (!grown) {
+                closedir(d);
+                free(*offsets);
+                *offsets = NULL;
+                return ELALLC;
+            }
+            *offsets = grown;
+        }
+
+        (*offsets)[(*count)++] = strtoull(dir->d_name, NULL, 10);
+    }
+    closedir(d);
+
+    // Directory order is arbitrary, the index needs increasing keys.
+    qsort(*offsets, *count, sizeof(uint64_t), compare_offsets);
+
+    return 0;
+}
+
+static void remove_pooled_files(const mqlog_t* lg) {
+    // Left behind by a previous run, which may have used another size.
+    DIR* d = opendir(lg->dir);
+    if (!d) {
+        return;
+    }
+
+    struct dirent *dir;
+    while ((dir = readdir(d)) != NULL) {
+        char path[MAX_DIR_SIZE];
+        if (has_suffix(dir->d_name, ".pool") &&
+            append_file_to_dir(path, MAX_DIR_SIZE, lg->dir,
+                               dir->d_name) == 0) {
+            unlink(path);
+        }
+    }
+    closedir(d);
+}
+
+static int segment_path(char* path, const mqlog_t* lg, uint64_t offset) {
+    const int n = snprintf(path, MAX_DIR_SIZE, "%s/%"PRIu64".log",
+                           lg->dir, offset);
+    return n < MAX_DIR_SIZE ? 0 : ELSOFLW;
+}
+
+static int register_segment(mqlog_t* lg,
+                            segment_t** sgm_ptr,
+                            uint64_t offset,
+                            uint32_t size) {
+    // Segments are mapped when needed: registering
+    // a segment doesn't depend on its content.
+    segment_t* sgm = 0;
+    int rc = segment_register(&sgm, lg->dir, offset, size,
+                              segment_flags(lg),
+                              lg->index_interval);
+    if (rc != 0) {
+        return ELLDSGM;
+    }
+
+    rc = index_segment(lg, sgm);
+    if (rc != 0) {
+        segment_close(sgm);
+        return rc == ELIDXPC ? rc : ELLDSGM;
+    }
+
+    *sgm_ptr = sgm;
+
+    return 0;
+}
+
+static int load_tail(mqlog_t* lg,
+                     segment_t* sgm,
+                     const struct manifest_checkpoint* checkpoint) {
+    int rc = 0;
+    if (checkpoint &&
+        checkpoint->base_offset == segment_base_offset(sgm)) {
+        rc = segment_map_from(sgm, checkpoint->index, checkpoint->data);
+    } else {
+        rc = segment_map(sgm);
+    }
+    if (rc != 0) {
+        return ELLDSGM;
+    }
+
+    // Producers append to the segment with the highest base offset.
+    publish_segment(lg, sgm);
+
+    return 0;
+}
+
+static int register_file(mqlog_t* lg, segment_t** sgm, uint64_t offset) {
+    char str[MAX_DIR_SIZE];
+    ssize_t size = -1;
+    if (segment_path(str, lg, offset) == 0) {
+        size = file_size(str);
+    }
+    if (size == -1) {
+        return ELLDSGM;
+    }
+
+    return register_segment(lg, sgm, offset, size);
+}
+
+static int load_segments(mqlog_t* lg) {
+    uint64_t* offsets = NULL;
+    size_t count = 0;
+    int rc = list_segments(lg, &offsets, &count);
+    if (rc != 0) {
+        return rc;
+    }
+
+    segment_t* sgm = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        rc = register_file(lg, &sgm, offsets[i]);
+        if (rc != 0) {
+            free(offsets);
+            return rc;
+        }
+    }
+
+    free(offsets);
+
+    if (sgm) {
+        return load_tail(lg, sgm, NULL);
+    }
+
+    return 0;
+}
+
+static int load_manifest(mqlog_t* lg, int* repaired) {
+    struct manifest_entry* entries = NULL;
+    size_t count = 0;
+    struct manifest_checkpoint checkpoint;
+    int rc = manifest_read(lg->dir, &entries, &count, &checkpoint);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // The manifest is trusted as long as its tail segment exists,
+    // sealed segments are checked when mapped.
+    char str[MAX_DIR_SIZE];
+    if (count == 0 ||
+        segment_path(str, lg, entries[count - 1].base_offset) != 0 ||
+        !file_exists(str)) {
+        free(entries);
+        return ELMNFST;
+    }
+
+    segment_t* sgm = NULL;
+    for (size_t i = 0; i < count; ++i) {
+        rc = register_segment(lg, &sgm, entries[i].base_offset,
+                              entries[i].size);
+        if (rc != 0) {
+            free(entries);
+            return rc;
+        }
+
+        if (entries[i].flags & MANIFEST_FINAL) {
+            segment_set_final(sgm, entries[i].index, entries[i].data);
+        }
+    }
+
+    free(entries);
+
+    rc = load_tail(lg, sgm, &checkpoint);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Segments created after the manifest was written: a segment
+    // is created before being added to the manifest.
+    while (segment_sealed(lg->active)) {
+        const uint64_t offset = segment_write_offset(lg->active);
+        ssize_t size = -1;
+        if (segment_path(str, lg, offset) == 0 && file_exists(str)) {
+            size = file_size(str);
+        }
+        if (size == -1) {
+            break;
+        }
+
+        rc = register_segment(lg, &sgm, offset, size);
+        if (rc != 0) {
+            return rc;
+        }
+
+        rc = load_tail(lg, sgm, NULL);
+        if (rc != 0) {
+            return rc;
+        }
+
+        *repaired = 1;
+    }
+
+    return 0;
+}
+
+struct recovery {
+    segment_t**     segments;
+    size_t          count;
+    volatile size_t next;  // next segment to recover
+    volatile int    rc;    // first error
+};
+
+static void* recover_task(void* arg) {
+    struct recovery* recovery = (struct recovery*)arg;
+
+    for (;;) {
+        const size_t i = __sync_fetch_and_add(&recovery->next, 1);
+        if (i >= recovery->count) {
+            break;
+        }
+
+        // Not the tail: no frame is written to the segment anymore.
+        // Offsets of the frames lost are not used again, the next
+        // segment starts after them.
+        segment_t* sgm = recovery->segments[i];
+        int rc = segment_recover(sgm, 0, 0);
+        if (rc == 0) {
+            rc = segment_seal(sgm);
+            // Mapped again when read.
+            const int unmapped = segment_unmap(sgm);
+            rc = rc == 0 ? unmapped : rc;
+        }
+
+        if (rc != 0) {
+            __sync_bool_compare_and_swap(&recovery->rc, 0, rc);
+        }
+    }
+
+    return NULL;
+}
+
+static int recover_segments(segment_t** segments, size_t count) {
+    struct recovery recovery = {
+        .segments = segments,
+        .count = count,
+        .next = 0,
+        .rc = 0
+    };
+
+    // Segments are independent: they are checked in parallel,
+    // the calling thread included.
+    const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    const size_t threads_count = min(min((size_t)max(cpus, 1), count),
+                                     (size_t)MAX_RECOVERY_THREADS);
+
+    pthread_t threads[MAX_RECOVERY_THREADS];
+    size_t started = 0;
+    while (started + 1 < threads_count &&
+           pthread_create(&threads[started], NULL,
+                          recover_task, &recovery) == 0) {
+        ++started;
+    }
+
+    recover_task(&recovery);
+
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+
+    return recovery.rc;
+}
+
+static int recover_log(mqlog_t* lg) {
+    // After a crash the segment files are used, the manifest only
+    // gives the sync point of the tail segment.
+    struct manifest_entry* entries = NULL;
+    size_t entries_count = 0;
+    struct manifest_checkpoint checkpoint;
+    if (manifest_read(lg->dir, &entries, &entries_count, &checkpoint) != 0) {
+        memset(&checkpoint, 0, sizeof(struct manifest_checkpoint));
+    }
+    free(entries);
+
+    uint64_t* offsets = NULL;
+    size_t count = 0;
+    int rc = list_segments(lg, &offsets, &count);
+    if (rc != 0 || count == 0) {
+        free(offsets);
+        return rc;
+    }
+
+    segment_t** segments = (segment_t**)malloc(count * sizeof(segment_t*));
+    if (!segments) {
+        free(offsets);
+        return ELALLC;
+    }
+
+    for (size_t i = 0; i < count && rc == 0; ++i) {
+        rc = register_file(lg, &segments[i], offsets[i]);
+    }
+
+    free(offsets);
+
+    if (rc == 0) {
+        rc = recover_segments(segments, count - 1);
+    }
+
+    if (rc == 0) {
+        segment_t* tail = segments[count - 1];
+        uint32_t index = 0;
+        uint32_t data = 0;
+        if (checkpoint.base_offset == segment_base_offset(tail)) {
+            index = checkpoint.index;
+            data = checkpoint.data;
+        }
+
+        rc = segment_recover(tail, index, data);
+        if (rc == 0) {
+            publish_segment(lg, tail);
+        }
+    }
+
+    free(segments);
+
+    return rc == 0 || rc == ELIDXPC ? rc : ELLDSGM;
+}
+
+static int load_log(mqlog_t* lg) {
+    int repaired = 0;
+    int rc = 0;
+    if ((lg->flags & MQLOG_RECOVER) == MQLOG_RECOVER) {
+        rc = recover_log(lg);
+        repaired = 1;
+    } else {
+        rc = load_manifest(lg, &repaired);
+    }
+
+    if (rc == ELMNFST) {
+        // No manifest, or not usable: the log is rebuilt from the
+        // segment files, then the manifest is written for next time.
+        rc = load_segments(lg);
+        repaired = 1;
+    }
+
+    if (rc == 0 && repaired && lg->active) {
+        write_manifest(lg);
+    }
+
+    return rc;
+}
+
+static int untrack_segment(mqlog_t* lg, const segment_t* sgm) {
+    // Called with `map_lock` held. Segments not tracked may have
+    // been written too.
+    int written = 1;
+    for (size_t i = 0; i < lg->mapped_count; ++i) {
+        if (lg->mapped[i].sgm == sgm) {
+            written = lg->mapped[i].written;
+            lg->mapped[i] = lg->mapped[--lg->mapped_count];
+            break;
+        }
+    }
+
+    // The order of the dirty segments is kept.
+    for (size_t i = 0; i < lg->dirty_count; ++i) {
+        if (lg->dirty[i] == sgm) {
+            memmove(&lg->dirty[i], &lg->dirty[i + 1],
+                    (lg->dirty_count - i - 1) * sizeof(segment_t*));
+            --lg->dirty_count;
+            break;
+        }
+    }
+
+    return written;
+}
+
+static int add_condemned(mqlog_t* lg,
+                         segment_t* sgm,
+                         segment_t* pooled,
+                         int written) {
+    // Called with `map_lock` held.
+    if (lg->condemned_count == lg->condemned_capacity) {
+        const size_t capacity = max(2 * lg->condemned_capacity, 16);
+        struct condemned* condemned = (struct condemned*)realloc(
+            lg->condemned, capacity * sizeof(struct condemned));
+        if (!condemned) {
+            // The segment stays mapped until the log is closed.
+            return ELALLC;
+        }
+        lg->condemned = condemned;
+        lg->condemned_capacity = capacity;
+    }
+
+    struct condemned* c = &lg->condemned[lg->condemned_count++];
+    c->sgm = sgm;
+    c->pooled = pooled;
+    c->written = written;
+
+    return 0;
+}
+
+static void add_pooled(mqlog_t* lg, segment_t* pooled) {
+    // Called with `map_lock` held, once the expired segment is
+    // unmapped: the files are cleared when reused.
+    if (lg->pool_count == lg->max_pooled_segments) {
+        segment_delete(pooled);
+        return;
+    }
+
+    // Sections started from now on can't reach the old mapping.
+    struct pooled_segment* p = &lg->pool[lg->pool_count++];
+    p->sgm = pooled;
+    p->epoch = lg->epoch - 1;
+}
+
+static segment_t* take_pooled(mqlog_t* lg) {
+    if (lg->pool_count == 0 || pthread_mutex_lock(&lg->map_lock) != 0) {
+        return NULL;
+    }
+
+    // Like a retired mapping: a section started at the epoch of the
+    // pooled segment, or before, may still read the old frames.
+    segment_t* sgm = NULL;
+    __sync_synchronize();
+    if (lg->pool_count > 0 && lg->pool[0].epoch < oldest_section(lg)) {
+        sgm = lg->pool[0].sgm;
+        --lg->pool_count;
+        memmove(&lg->pool[0], &lg->pool[1],
+                lg->pool_count * sizeof(struct pooled_segment));
+    }
+    pthread_mutex_unlock(&lg->map_lock);
+
+    if (sgm && segment_reuse(sgm) != 0) {
+        segment_delete(sgm);
+        return NULL;
+    }
+
+    return sgm;
+}
+
+static void discard_condemned(mqlog_t* lg) {
+    // Called with `map_lock` held. Segments being read, or still
+    // written like in `evict_segments`, are unmapped by a later run.
+    size_t kept = 0;
+    for (size_t i = 0; i < lg->condemned_count; ++i) {
+        const struct condemned c = lg->condemned[i];
+        struct segment_mapping mapping;
+        if (segment_mapped(c.sgm)) {
+            if ((c.written && !segment_quiescent(c.sgm)) ||
+                segment_detach(c.sgm, 0, &mapping) != 0) {
+                lg->condemned[kept++] = c;
+                continue;
+            }
+            retire_mapping(lg, &mapping);
+        }
+
+        if (c.pooled) {
+            add_pooled(lg, c.pooled);
+        }
+        retire_segment(lg, c.sgm);
+    }
+    lg->condemned_count = kept;
+
+    reclaim_mappings(lg);
+    reclaim_segments(lg);
+}
+
+static segment_t* recycle_segment(mqlog_t* lg, const segment_t* sgm) {
+    // Segments loaded with another size are not recycled.
+    if ((lg->flags & MQLOG_RECYCLE) != MQLOG_RECYCLE ||
+        segment_size(sgm) != lg->size) {
+        return NULL;
+    }
+
+    segment_t* pooled = NULL;
+    if (segment_recycle(&pooled, sgm, lg->dir, lg->pooled_files++) != 0) {
+        return NULL;
+    }
+
+    return pooled;
+}
+
+static uint64_t segment_age_ms(const mqlog_t* lg, uint64_t base_offset) {
+    // The files of sealed segments are last modified when sealed.
+    char path[MAX_DIR_SIZE];
+    struct stat st;
+    if (segment_path(path, lg, base_offset) != 0 || stat(path, &st) != 0) {
+        return 0;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const int64_t ms = (int64_t)(now.tv_sec - st.st_mtim.tv_sec) * 1000 +
+                       (now.tv_nsec - st.st_mtim.tv_nsec) / 1000000;
+    return ms > 0 ? (uint64_t)ms : 0;
+}
+
+static int expired(const mqlog_t* lg,
+                   uint64_t base_offset,
+                   size_t segments,
+                   uint64_t bytes) {
+    if (lg->max_retained_segments > 0 &&
+        segments > lg->max_retained_segments) {
+        return 1;
+    }
+
+    if (lg->max_retained_bytes > 0 && bytes > lg->max_retained_bytes) {
+        return 1;
+    }
+
+    return lg->max_segment_age_ms > 0 &&
+           segment_age_ms(lg, base_offset) > lg->max_segment_age_ms;
+}
+
+static void expire_segments(mqlog_t* lg) {
+    // Worker thread only. Expired segments are the oldest ones,
+    // the active segment is always retained.
+    const struct segment_table* table = lg->segments;
+    segment_t* active = lg->active;
+    if (!table || !active) {
+        return;
+    }
+
+    const size_t count = table->count;
+    uint64_t bytes = 0;
+    for (size_t i = 0; i < count; ++i) {
+        bytes += segment_size(table->entries[i].sgm);
+    }
+
+    size_t first = 0;
+    while (table->entries[first].base_offset <
+               segment_base_offset(active) &&
+           expired(lg, table->entries[first].base_offset,
+                   count - first, bytes)) {
+        bytes -= segment_size(table->entries[first].sgm);
+        ++first;
+    }
+
+    // The oldest sealed segment retained expires next by age.
+    const uint64_t oldest = table->entries[first].base_offset;
+    lg->age_check_at = 0;
+    if (lg->max_segment_age_ms > 0 && oldest < segment_base_offset(active)) {
+        const uint64_t age = segment_age_ms(lg, oldest);
+        lg->age_check_at = now_ms() + 1 +
+            (age < lg->max_segment_age_ms ? lg->max_segment_age_ms - age : 0);
+    }
+
+    // Kept aside: the table entries are moved.
+    segment_t** expired = NULL;
+    if (first > 0) {
+        expired = (segment_t**)malloc(first * sizeof(segment_t*));
+        if (!expired) {
+            return;
+        }
+        for (size_t i = 0; i < first; ++i) {
+            expired[i] = table->entries[i].sgm;
+        }
+    }
+
+    int rc = 0;
+    if (first > 0) {
+        // Readers below the low-water mark get ELOSLOW from now on,
+        // then stop finding the expired segments. Rolls may have
+        // replaced the table, with the same entries at the front.
+        lg->low_water = oldest;
+        lock_table(lg);
+        struct segment_table* retained = lg->segments;
+        memmove(retained->entries, retained->entries + first,
+                (retained->count - first) * sizeof(struct table_entry));
+        retained->count -= first;
+        unlock_table(lg);
+
+        // Files are only removed once the manifest doesn't list
+        // them: they would be loaded again otherwise.
+        rc = write_manifest(lg);
+    }
+
+    pthread_mutex_lock(&lg->map_lock);
+    for (size_t i = 0; i < first; ++i) {
+        segment_t* sgm = expired[i];
+        const int written = untrack_segment(lg, sgm);
+        segment_t* pooled = NULL;
+        if (rc == 0) {
+            // The files are renamed right away, then reused once the
+            // segment is unmapped.
+            pooled = recycle_segment(lg, sgm);
+            if (!pooled) {
+                segment_unlink(sgm);
+            }
+        }
+        if (add_condemned(lg, sgm, pooled, written) != 0 && pooled) {
+            segment_delete(pooled);
+        }
+    }
+    discard_condemned(lg);
+    pthread_mutex_unlock(&lg->map_lock);
+
+    free(expired);
+}
+
+static void start_deadline(const struct timespec* timeout,
+                           struct timespec* deadline) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout->tv_sec;
+    deadline->tv_nsec += timeout->tv_nsec;
+    if (deadline->tv_nsec >= 1000000000) {
+        ++deadline->tv_sec;
+        deadline->tv_nsec -= 1000000000;
+    }
+}
+
+static int deadline_remaining(const struct timespec* deadline,
+                              struct timespec* remaining) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int64_t ns = (int64_t)(deadline->tv_sec - now.tv_sec) * 1000000000 +
+                 (deadline->tv_nsec - now.tv_nsec);
+    if (ns <= 0) {
+        return 0;
+    }
+
+    remaining->tv_sec = ns / 1000000000;
+    remaining->tv_nsec = ns % 1000000000;
+    return 1;
+}
+
+static int snapshot_dirty(mqlog_t* lg, size_t* count) {
+    // Called with `map_lock` held, by the flushing thread.
+    if (lg->flush_capacity < lg->dirty_count) {
+        segment_t** segments = (segment_t**)realloc(
+            lg->flush_segments, lg->dirty_count * sizeof(segment_t*));
+        if (!segments) {
+            return ELALLC;
+        }
+        lg->flush_segments = segments;
+        lg->flush_capacity = lg->dirty_count;
+    }
+
+    // Pinned while synced. Unmapping a segment syncs it.
+    size_t n = 0;
+    for (size_t i = 0; i < lg->dirty_count; ++i) {
+        if (segment_acquire(lg->dirty[i]) == 0) {
+            lg->flush_segments[n++] = lg->dirty[i];
+        }
+    }
+    *count = n;
+
+    return 0;
+}
+
+static void remove_durable(mqlog_t* lg) {
+    // Called with `map_lock` held. Keeps the order of the dirty
+    // segments: the first one bounds the durable offset.
+    size_t kept = 0;
+    for (size_t i = 0; i < lg->dirty_count; ++i) {
+        segment_t* sgm = lg->dirty[i];
+        if (!segment_durable(sgm) && segment_mapped(sgm)) {
+            lg->dirty[kept++] = sgm;
+        }
+    }
+    lg->dirty_count = kept;
+}
+
+static uint64_t synced_offset(const segment_t* sgm) {
+    uint32_t index = 0;
+    uint32_t data = 0;
+    segment_synced(sgm, &index, &data);
+    return segment_base_offset(sgm) + index;
+}
+
+static ssize_t flush_log(mqlog_t* lg) {
+    // Read first: a segment sealed afterwards is in the dirty ones.
+    segment_t* active = lg->active;
+    if (!active) {
+        return 0;
+    }
+
+    size_t count = 0;
+    pthread_mutex_lock(&lg->map_lock);
+    int rc = snapshot_dirty(lg, &count);
+    pthread_mutex_unlock(&lg->map_lock);
+    if (rc != 0) {
+        return rc;
+    }
+
+    ssize_t synced = 0;
+    for (size_t i = 0; i < count; ++i) {
+        const ssize_t n = segment_sync(lg->flush_segments[i]);
+        if (n < 0) {
+            rc = (int)n;
+        } else {
+            synced += n;
+        }
+        segment_release(lg->flush_segments[i]);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Pinned like the dirty ones: it may be evicted meanwhile.
+    ssize_t n = 0;
+    if (segment_acquire(active) == 0) {
+        n = segment_sync(active);
+        segment_release(active);
+    }
+    if (n < 0) {
+        return n;
+    }
+    synced += n;
+
+    if (n > 0) {
+        // Opening the log checks frames after the checkpoint only.
+        struct manifest_checkpoint checkpoint;
+        checkpoint.base_offset = segment_base_offset(active);
+        segment_synced(active, &checkpoint.index, &checkpoint.data);
+        manifest_checkpoint(lg->dir, &checkpoint);
+    }
+
+    // Frames below the first segment not fully synced are durable.
+    pthread_mutex_lock(&lg->map_lock);
+    remove_durable(lg);
+    const uint64_t durable = lg->dirty_count > 0 ?
+        synced_offset(lg->dirty[0]) : synced_offset(active);
+    pthread_mutex_unlock(&lg->map_lock);
+
+    if (durable > lg->durable) {
+        lg->durable = durable;
+        if (lg->on_durable) {
+            lg->on_durable(durable, lg->on_durable_arg);
+        }
+    }
+
+    return synced;
+}
+
+static ssize_t sync_log(mqlog_t* lg, int coalesce) {
+    if (pthread_mutex_lock(&lg->sync_lock) != 0) {
+        return ELLCKOP;
+    }
+
+    // A flush in progress may have started before the frames of the
+    // caller were written: the next one is waited for. Callers
+    // waiting together are all served by the same flush.
+    const uint64_t target = lg->flushes_started + 1;
+    ssize_t rc = 0;
+    for (;;) {
+        if (coalesce && lg->flushes_done >= target) {
+            rc = lg->flush_result;
+            break;
+        }
+
+        if (!lg->flushing) {
+            lg->flushing = 1;
+            ++lg->flushes_started;
+            pthread_mutex_unlock(&lg->sync_lock);
+
+            rc = flush_log(lg);
+
+            pthread_mutex_lock(&lg->sync_lock);
+            lg->flushing = 0;
+            lg->flush_result = rc;
+            ++lg->flushes_done;
+            pthread_cond_broadcast(&lg->flushed);
+            break;
+        }
+
+        pthread_cond_wait(&lg->flushed, &lg->sync_lock);
+    }
+
+    if (pthread_mutex_unlock(&lg->sync_lock) != 0) {
+        return ELLCKOP;
+    }
+
+    // MQLOG_RDCMT: the frames synced can be read.
+    if ((lg->flags & MQLOG_RDCMT) == MQLOG_RDCMT && rc > 0) {
+        notify_readers(lg);
+    }
+
+    return rc;
+}
+
+static ssize_t flush_or_park(mqlog_t* lg,
+                             int coalesce,
+                             const struct timespec* timeout) {
+    // Registered before flushing: a frame published afterwards
+    // changes `published` and the futex wait returns straight away.
+    __sync_add_and_fetch(&lg->read_waiters, 1);
+    const uint32_t published = lg->published;
+    const uint64_t durable = lg->durable;
+
+    const ssize_t rc = sync_log(lg, coalesce);
+
+    // No progress: frames claimed by other producers aren't written
+    // yet, flushing again before they are would only call msync.
+    if (rc >= 0 && lg->durable == durable) {
+        futex_wait(&lg->published, published, timeout);
+    }
+    __sync_sub_and_fetch(&lg->read_waiters, 1);
+
+    return rc;
+}
+
+static ssize_t wait_durable(mqlog_t* lg, uint64_t offset) {
+    // Frames before `offset` claimed by other producers may not be
+    // written yet: the log is flushed until they are.
+    const int coalesce = lg->sync_policy == MQLOG_SYNC_GROUP;
+    while (lg->durable <= offset) {
+        const ssize_t rc = flush_or_park(lg, coalesce, NULL);
+        if (rc < 0) {
+            return rc;
+        }
+    }
+
+    return 0;
+}
+
+static ssize_t sync_write(mqlog_t* lg, uint64_t offset) {
+    if (lg->sync_policy != MQLOG_SYNC_WRITE &&
+        lg->sync_policy != MQLOG_SYNC_GROUP) {
+        return 0;
+    }
+
+    // Covers the frames of the caller only, up to `offset`.
+    return wait_durable(lg, offset);
+}
+
+void mqlog_options_init(struct mqlog_options* options) {
+    memset(options, 0, sizeof(struct mqlog_options));
+    options->prepare_threshold = DEFAULT_PREPARE_THRESHOLD;
+    options->prefault_window = DEFAULT_PREFAULT_WINDOW;
+    options->index_interval = DEFAULT_INDEX_INTERVAL;
+    options->max_mapped_segments = 0;
+    options->max_mapped_bytes = 0;
+    options->max_pooled_segments = DEFAULT_POOLED_SEGMENTS;
+    options->sync_policy = MQLOG_SYNC_NONE;
+    options->sync_interval_ms = DEFAULT_SYNC_INTERVAL_MS;
+    options->sync_bytes = DEFAULT_SYNC_BYTES;
+}
+
+int mqlog_open(mqlog_t** lg_ptr,
+             const char* dir,
+             size_t size,
+             unsigned int flags) {
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = flags;
+
+    return mqlog_open_options(lg_ptr, dir, size, &options);
+}
+
+int mqlog_open_options(mqlog_t** lg_ptr,
+                       const char* dir,
+                       size_t size,
+                       const struct mqlog_options* options) {
+    // Size has to be a multiple of page size.
+    if (size % pagesize() != 0) {
+        return ELNOPGM;
+    }
+
+    if (ensure_directory(dir) != 0) {
+        return ELLGDIR;
+    }
+
+    struct mqlog* lg = (struct mqlog*)malloc(sizeof(struct mqlog));
+    if (!lg) {
+        return ELALLC;
+    }
+
+    // Initialize segment struct.
+    memset(lg, 0, sizeof(struct mqlog));
+    lg->size = size;
+    snprintf(lg->dir, MAX_DIR_SIZE, "%s", dir);
+
+    lg->flags = options->flags;
+    lg->index_interval = options->index_interval;
+    lg->max_mapped_segments = options->max_mapped_segments;
+    lg->max_mapped_bytes = options->max_mapped_bytes;
+    lg->max_retained_segments = options->max_retained_segments;
+    lg->max_retained_bytes = options->max_retained_bytes;
+    lg->max_segment_age_ms = options->max_segment_age_ms;
+    if ((lg->flags & MQLOG_RECYCLE) == MQLOG_RECYCLE) {
+        lg->max_pooled_segments = options->max_pooled_segments;
+    }
+
+    lg->event_fd = -1;
+    lg->epoch = 1;
+
+    const size_t sections = MAX_READERS + MAX_THREADS;
+    void* readers = NULL;
+    if (posix_memalign(&readers, CACHE_LINE_SIZE,
+                       sections * sizeof(struct mqlog_reader)) != 0) {
+        mqlog_close(lg);
+        return ELALLC;
+    }
+    memset(readers, 0, sections * sizeof(struct mqlog_reader));
+    lg->readers = (struct mqlog_reader*)readers;
+    lg->threads = lg->readers + MAX_READERS;
+
+    if (pthread_key_create(&lg->thread_key, release_thread) != 0) {
+        mqlog_close(lg);
+        return ELALLC;
+    }
+    lg->has_thread_key = 1;
+
+    if (lg->max_pooled_segments > 0) {
+        lg->pool = (struct pooled_segment*)malloc(
+            lg->max_pooled_segments * sizeof(struct pooled_segment));
+        if (!lg->pool) {
+            mqlog_close(lg);
+            return ELALLC;
+        }
+        remove_pooled_files(lg);
+    }
+
+    if ((lg->flags & MQLOG_EVENTFD) == MQLOG_EVENTFD) {
+        lg->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (lg->event_fd < 0) {
+            mqlog_close(lg);
+            return ELEVTFD;
+        }
+    }
+
+    if (pthread_mutex_init(&lg->lock, NULL)) {
+        mqlog_close(lg);
+        return ELLCKOP;
+    }
+
+    if (pthread_mutex_init(&lg->map_lock, NULL) ||
+        pthread_mutex_init(&lg->manifest_lock, NULL)) {
+        mqlog_close(lg);
+        return ELLCKOP;
+    }
+
+    // Durability waits have a monotonic deadline.
+    pthread_condattr_t attr;
+    if (pthread_mutex_init(&lg->sync_lock, NULL) ||
+        pthread_condattr_init(&attr) ||
+        pthread_condattr_setclock(&attr, CLOCK_MONOTONIC) ||
+        pthread_cond_init(&lg->flushed, &attr)) {
+        mqlog_close(lg);
+        return ELLCKOP;
+    }
+    pthread_condattr_destroy(&attr);
+
+    int rc = load_log(lg);
+    if (rc != 0) {
+        mqlog_close(lg);
+        return  rc;
+    }
+
+    if ((lg->flags & MQLOG_PREPARE) == MQLOG_PREPARE) {
+        const unsigned int threshold = min(options->prepare_threshold, 100);
+        // A segment is never prepared before the first write.
+        lg->prepare_at = max((uint64_t)size * threshold / 100, 1);
+    }
+
+    if ((lg->flags & MQLOG_PREFAULT) == MQLOG_PREFAULT) {
+        const size_t window = page_aligned_addr(options->prefault_window);
+        lg->prefault_window = min(max(window, pagesize()), size);
+    }
+
+    // Frames found at open are synced.
+    if (lg->active) {
+        lg->durable = synced_offset(lg->active);
+    }
+
+    // Segments expired before are not in the log anymore.
+    if (lg->segments && lg->segments->count > 0) {
+        lg->low_water = lg->segments->entries[0].base_offset;
+    }
+
+    lg->sync_policy = options->sync_policy;
+    lg->on_durable = options->on_durable;
+    lg->on_durable_arg = options->on_durable_arg;
+    lg->sync_bytes = max(options->sync_bytes, 1);
+    lg->sync_interval_ms = max(options->sync_interval_ms, 1);
+    lg->synced_at = now_ms();
+    unsigned int interval_ms = 0;
+    if (lg->sync_policy == MQLOG_SYNC_INTERVAL) {
+        interval_ms = lg->sync_interval_ms;
+    }
+
+    if (lg->prepare_at > 0 ||
+        lg->prefault_window > 0 ||
+        lg->sync_policy == MQLOG_SYNC_INTERVAL ||
+        lg->sync_policy == MQLOG_SYNC_BYTES ||
+        retaining(lg)) {
+        rc = worker_start(&lg->worker, run_tasks, lg, interval_ms);
+        if (rc != 0) {
+            mqlog_close(lg);
+            return rc;
+        }
+
+        // Loaded segments may be expired already, the task then
+        // schedules the next age check.
+        if (retaining(lg)) {
+            request_task(lg, TASK_RETAIN);
+        }
+    }
+
+    *lg_ptr = lg;
+
+    return 0;
+}
+
+int mqlog_close(mqlog_t* lg) {
+    int errors = 0;
+
+    if (lg->worker) {
+        if (worker_stop(lg->worker) != 0) {
+            ++errors;
+        }
+    }
+
+    // Synced first: the manifest has the final offsets of every
+    // sealed segment mapped, the next open doesn't search them.
+    if (lg->active) {
+        mqlog_sync(lg);
+        write_manifest(lg);
+    }
+
+    // The spare segment is not part of the log.
+    if (lg->prepared) {
+        if (segment_delete(lg->prepared) != 0) {
+            ++errors;
+        }
+    }
+
+    // Expired segments are not synced, their files are gone.
+    for (size_t i = 0; i < lg->condemned_count; ++i) {
+        segment_discard(lg->condemned[i].sgm);
+        segment_close(lg->condemned[i].sgm);
+        if (lg->condemned[i].pooled) {
+            segment_delete(lg->condemned[i].pooled);
+        }
+    }
+
+    // Unmapped already.
+    for (size_t i = 0; i < lg->expired_count; ++i) {
+        segment_close(lg->expired[i].sgm);
+    }
+    free(lg->expired);
+
+    // Pooled files are not reused by a later run.
+    for (size_t i = 0; i < lg->pool_count; ++i) {
+        segment_delete(lg->pool[i].sgm);
+    }
+
+    // Read sections are over.
+    for (size_t i = 0; i < lg->retired_count; ++i) {
+        segment_release_mapping(&lg->retired[i].mapping);
+    }
+
+    if (lg->segments) {
+        const struct segment_table* table = lg->segments;
+        for (size_t i = 0; i < table->count; ++i) {
+            if (segment_close(table->entries[i].sgm) != 0) {
+                ++errors;
+            }
+        }
+    }
+
+    struct segment_table* table = lg->segments;
+    while (table) {
+        struct segment_table* retired = table->retired;
+        free(table);
+        table = retired;
+    }
+
+    if (lg->event_fd >= 0) {
+        close(lg->event_fd);
+    }
+
+    // Threads exiting later don't release their section.
+    if (lg->has_thread_key) {
+        pthread_key_delete(lg->thread_key);
+    }
+
+    pthread_mutex_destroy(&lg->lock);
+    pthread_mutex_destroy(&lg->map_lock);
+    pthread_mutex_destroy(&lg->manifest_lock);
+    pthread_mutex_destroy(&lg->sync_lock);
+    pthread_cond_destroy(&lg->flushed);
+    free(lg->dirty);
+    free(lg->condemned);
+    free(lg->pool);
+    free(lg->retired);
+    free(lg->readers);
+    free(lg->flush_segments);
+    free(lg->mapped);
+
+    free(lg);
+    return errors == 0 ? 0 : ELLGCLS;
+}
+
+ssize_t mqlog_write(mqlog_t* lg, const void* buf, size_t size) {
+    if (size == 0) {
+        return 0;
+    }
+
+    // Handling payloads greater than the segment size
+    // is currently not supported.
+    if (size > segment_max_payload(lg->size)) {
+        return ELNOWCP;
+    }
+
+    // No lock is taken in the steady state: producers claim their
+    // frame directly in the active segment. The section keeps the
+    // segment from being freed, should it be sealed and expire.
+    for (;;) {
+        struct mqlog_reader* section = enter_implicit(lg);
+
+        // Read before `active`, a roll in between is not missed.
+        const uint32_t rolls = lg->rolls;
+        segment_t* sgm = lg->active;
+        if (sgm) {
+            uint64_t relative_offset = 0;
+            const ssize_t written = segment_write(sgm, buf, size,
+                                                  &relative_offset);
+            if (written != ELEOS) {
+                if (written > 0) {
+                    notify_readers(lg);
+                }
+                on_write(lg, sgm);
+
+                const uint64_t offset =
+                    segment_base_offset(sgm) + relative_offset;
+                exit_implicit(lg, section);
+
+                const ssize_t rc = written > 0 ? sync_write(lg, offset) : 0;
+                return rc < 0 ? rc : written;
+            }
+        }
+
+        const int rc = next_segment(lg, sgm, rolls);
+        exit_implicit(lg, section);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+}
+
+ssize_t mqlog_writev(mqlog_t* lg,
+                     const struct iovec* iov,
+                     int iovcnt,
+                     uint64_t* offset) {
+    for (int i = 0; i < iovcnt; ++i) {
+        if (iov[i].iov_len > segment_max_payload(lg->size)) {
+            return ELNOWCP;
+        }
+    }
+
+    ssize_t written = 0;
+    uint64_t last = 0;
+    int first = 1;
+    int done = 0;
+    while (done < iovcnt) {
+        // Like `mqlog_write`.
+        struct mqlog_reader* section = enter_implicit(lg);
+        const uint32_t rolls = lg->rolls;
+        segment_t* sgm = lg->active;
+        if (sgm) {
+            uint64_t relative_offset = 0;
+            uint32_t frames = 0;
+            const ssize_t n = segment_writev(sgm,
+                                             iov + done,
+                                             iovcnt - done,
+                                             &relative_offset,
+                                             &frames);
+            if (n > 0) {
+                // Empty payloads are consumed without a frame.
+                if (frames > 0) {
+                    const uint64_t from =
+                        segment_base_offset(sgm) + relative_offset;
+                    if (first) {
+                        *offset = from;
+                        first = 0;
+                    }
+                    last = from + frames - 1;
+                    notify_readers(lg);
+                    on_write(lg, sgm);
+                }
+
+                for (int i = done; i < done + n; ++i) {
+                    written += iov[i].iov_len;
+                }
+                done += n;
+                exit_implicit(lg, section);
+                continue;
+            }
+
+            if (n != ELEOS) {
+                exit_implicit(lg, section);
+                return written > 0 ? written : n;
+            }
+        }
+
+        // The rest of the batch goes to the next segment.
+        const int rc = next_segment(lg, sgm, rolls);
+        exit_implicit(lg, section);
+        if (rc != 0) {
+            // Part of the batch may have been inserted already.
+            return written > 0 ? written : rc;
+        }
+    }
+
+    const ssize_t rc = first ? 0 : sync_write(lg, last);
+    return rc < 0 ? rc : written;
+}
+
+int mqlog_reserve(mqlog_t* lg,
+                  size_t size,
+                  void** ptr,
+                  mqlog_ticket_t* ticket) {
+    if (size > segment_max_payload(lg->size)) {
+        return ELNOWCP;
+    }
+
+    // Like `mqlog_write`. Until committed, the frame keeps the
+    // segment mapped.
+    for (;;) {
+        struct mqlog_reader* section = enter_implicit(lg);
+        const uint32_t rolls = lg->rolls;
+        segment_t* sgm = lg->active;
+        if (sgm) {
+            struct segment_ticket sgm_ticket;
+            const int rc = segment_reserve(sgm, size, &sgm_ticket, ptr);
+            if (rc == 0) {
+                ticket->sgm = sgm;
+                ticket->offset = segment_base_offset(sgm) + sgm_ticket.index;
+                ticket->position = sgm_ticket.position;
+                ticket->size = sgm_ticket.size;
+                on_write(lg, sgm);
+                exit_implicit(lg, section);
+                return 0;
+            }
+
+            if (rc != ELEOS) {
+                exit_implicit(lg, section);
+                return rc;
+            }
+        }
+
+        const int rc = next_segment(lg, sgm, rolls);
+        exit_implicit(lg, section);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+}
+
+static ssize_t commit_frame(mqlog_t* lg,
+                            const mqlog_ticket_t* ticket,
+                            uint64_t* offset) {
+    segment_t* sgm = (segment_t*)ticket->sgm;
+
+    const struct segment_ticket sgm_ticket = {
+        .index = ticket->offset - segment_base_offset(sgm),
+        .position = ticket->position,
+        .size = ticket->size
+    };
+
+    // Once the frame is ready, the segment can expire.
+    struct mqlog_reader* section = enter_implicit(lg);
+    const ssize_t written = segment_commit(sgm, &sgm_ticket);
+    exit_implicit(lg, section);
+    if (written < 0) {
+        return written;
+    }
+
+    notify_readers(lg);
+
+    *offset = ticket->offset;
+    return written;
+}
+
+ssize_t mqlog_commit(mqlog_t* lg,
+                     const mqlog_ticket_t* ticket,
+                     uint64_t* offset) {
+    const ssize_t written = commit_frame(lg, ticket, offset);
+    if (written < 0) {
+        return written;
+    }
+
+    const ssize_t rc = sync_write(lg, ticket->offset);
+    return rc < 0 ? rc : written;
+}
+
+ssize_t mqlog_write_async(mqlog_t* lg,
+                          const void* buf,
+                          size_t size,
+                          uint64_t* offset) {
+    if (size == 0) {
+        return 0;
+    }
+
+    // Reserved to know the offset of the frame.
+    void* ptr = NULL;
+    mqlog_ticket_t ticket;
+    const int rc = mqlog_reserve(lg, size, &ptr, &ticket);
+    if (rc != 0) {
+        return rc;
+    }
+
+    memcpy(ptr, buf, size);
+    return commit_frame(lg, &ticket, offset);
+}
+
+ssize_t mqlog_read(mqlog_t* lg, uint64_t offset, struct frame* fr) {
+    return mqlog_tryread(lg, offset, fr);
+}
+
+ssize_t mqlog_readv(mqlog_t* lg,
+                    uint64_t offset,
+                    struct frame* frames,
+                    size_t max,
+                    size_t max_bytes) {
+    return mqlog_tryreadv(lg, offset, frames, max, max_bytes);
+}
+
+static int readable(ssize_t read) {
+    // A frame claimed but not published yet is waited for.
+    return read != ELNORD && read != ELINVHD;
+}
+
+ssize_t mqlog_read_wait(mqlog_t* lg,
+                        uint64_t offset,
+                        struct frame* fr,
+                        const struct timespec* timeout) {
+    struct timespec deadline;
+    if (timeout) {
+        start_deadline(timeout, &deadline);
+    }
+
+    for (int i = 0;; ++i) {
+        // Read before trying: a frame published afterwards
+        // makes the futex wait return straight away.
+        const uint32_t published = lg->published;
+
+        ssize_t read = mqlog_tryread(lg, offset, fr);
+        if (readable(read)) {
+            return read;
+        }
+
+        // Producers are usually close: spin first, then park.
+        if (i < SPIN_LIMIT) {
+            cpu_relax();
+            continue;
+        }
+
+        struct timespec remaining;
+        if (timeout && !deadline_remaining(&deadline, &remaining)) {
+            return read;
+        }
+
+        // Producers only wake up readers registered: the frame
+        // published before registering is read again.
+        __sync_add_and_fetch(&lg->read_waiters, 1);
+        read = mqlog_tryread(lg, offset, fr);
+        if (!readable(read)) {
+            futex_wait(&lg->published, published,
+                       timeout ? &remaining : NULL);
+        }
+        __sync_sub_and_fetch(&lg->read_waiters, 1);
+
+        if (readable(read)) {
+            return read;
+        }
+    }
+}
+
+int mqlog_eventfd(const mqlog_t* lg) {
+    return lg->event_fd >= 0 ? lg->event_fd : ELEVTFD;
+}
+
+int mqlog_arm(mqlog_t* lg, uint64_t offset) {
+    if (lg->event_fd < 0) {
+        return ELEVTFD;
+    }
+
+    // Like a reader registered, the offset is read once armed.
+    __sync_lock_test_and_set(&lg->armed, 1);
+    __sync_synchronize();
+
+    struct frame fr;
+    return readable(mqlog_tryread(lg, offset, &fr)) ? 1 : 0;
+}
+
+int mqlog_reader_open(mqlog_t* lg, mqlog_reader_t** reader) {
+    for (size_t i = 0; i < MAX_READERS; ++i) {
+        struct mqlog_reader* r = &lg->readers[i];
+        if (!r->used && __sync_bool_compare_and_swap(&r->used, 0, 1)) {
+            r->epoch = 0;
+            r->lg = lg;
+            *reader = r;
+            return 0;
+        }
+    }
+
+    return ELRDSLT;
+}
+
+void mqlog_reader_close(mqlog_reader_t* reader) {
+    mqlog_exit(reader);
+    reader->used = 0;
+}
+
+void mqlog_enter(mqlog_reader_t* reader) {
+    // Published before any segment is read: a mapping retired from
+    // now on waits for the section to be left.
+    reader->epoch = reader->lg->epoch;
+    __sync_synchronize();
+}
+
+void mqlog_exit(mqlog_reader_t* reader) {
+    // Frames are read before the section is left.
+    __sync_synchronize();
+    reader->epoch = 0;
+}
+
+int mqlog_cursor_init(mqlog_t* lg, uint64_t offset, mqlog_cursor_t* cursor) {
+    cursor->lg = lg;
+    cursor->sgm = NULL;
+    cursor->base = 0;
+    cursor->offset = offset;
+    cursor->position = 0;
+    cursor->hold = 0;
+
+    // Without a read section, segments are pinned by every read.
+    mqlog_reader_t* reader = NULL;
+    const int rc = mqlog_reader_open(lg, &reader);
+    cursor->reader = reader;
+
+    return rc;
+}
+
+void mqlog_cursor_hold(mqlog_cursor_t* cursor) {
+    cursor->hold = 1;
+}
+
+void mqlog_cursor_close(mqlog_cursor_t* cursor) {
+    if (cursor->reader) {
+        mqlog_reader_close((mqlog_reader_t*)cursor->reader);
+        cursor->reader = NULL;
+    }
+}
+
+static int enter_segment(mqlog_t* lg, segment_t* sgm) {
+    // In a read section: the mapping can't go away, even if the
+    // segment is unmapped right after.
+    return segment_mapped(sgm) ? 0 : map_segment(lg, sgm);
+}
+
+static ssize_t cursor_read(mqlog_cursor_t* cursor,
+                           mqlog_reader_t* reader,
+                           struct frame* fr) {
+    mqlog_t* lg = cursor->lg;
+    for (;;) {
+        segment_t* sgm = (segment_t*)cursor->sgm;
+        if (!sgm) {
+            sgm = find_segment(lg, cursor->offset);
+            if (!sgm) {
+                return missing_segment(lg, cursor->offset);
+            }
+            cursor->sgm = sgm;
+            cursor->base = segment_base_offset(sgm);
+        }
+
+        int rc = reader ? enter_segment(lg, sgm) : pin_segment(lg, sgm);
+        if (rc != 0) {
+            return rc;
+        }
+
+        const uint64_t base_offset = segment_base_offset(sgm);
+        struct segment_cursor at = {
+            .index = cursor->offset - base_offset,
+            .position = cursor->position
+        };
+
+        const ssize_t read = segment_read_next(sgm, &at, fr);
+        if (!reader) {
+            unpin_segment(lg, sgm);
+        }
+
+        if (read != ELEOS) {
+            if (read >= 0) {
+                cursor->offset = base_offset + at.index;
+                cursor->position = at.position;
+            }
+            return read;
+        }
+
+        // Last frame of the segment read: the index is only
+        // searched at segment boundaries.
+        segment_t* next = following_segment(lg, sgm);
+        if (!next) {
+            // The next segment is being rolled.
+            return ELNORD;
+        }
+
+        // Offsets lost by a recovery are skipped.
+        cursor->sgm = next;
+        cursor->base = segment_base_offset(next);
+        cursor->offset = cursor->base;
+        cursor->position = 0;
+    }
+}
+
+ssize_t mqlog_cursor_next(mqlog_cursor_t* cursor, struct frame* fr) {
+    // The frame read by the previous call is not used anymore.
+    mqlog_t* lg = cursor->lg;
+    mqlog_reader_t* reader = (mqlog_reader_t*)cursor->reader;
+    struct mqlog_reader* section = NULL;
+    if (reader) {
+        mqlog_enter(reader);
+    } else {
+        section = enter_implicit(lg);
+    }
+
+    // The segment of an idle cursor may have expired, and been freed
+    // since: it is looked up again, and not found. Its offset can be
+    // the low-water mark, past its last frame.
+    if (cursor->sgm && cursor->base < lg->low_water) {
+        cursor->sgm = NULL;
+        cursor->position = 0;
+    }
+
+    const ssize_t read = cursor_read(cursor, reader, fr);
+
+    // Unless held, the section is left: an idle cursor doesn't keep
+    // retired mappings and pooled segments from being reclaimed.
+    if (!reader) {
+        exit_implicit(lg, section);
+    } else if (!cursor->hold || read < 0) {
+        mqlog_exit(reader);
+    }
+
+    return read;
+}
+
+ssize_t mqlog_sync(mqlog_t* lg) {
+    // Concurrent callers are coalesced into one flush.
+    return sync_log(lg, 1);
+}
+
+uint64_t mqlog_durable_offset(const mqlog_t* lg) {
+    return lg->durable;
+}
+
+static int flush_in_caller(mqlog_t* lg,
+                           uint64_t offset,
+                           const struct timespec* timeout) {
+    struct timespec deadline;
+    if (timeout) {
+        start_deadline(timeout, &deadline);
+    }
+
+    // Callers waiting together share flushes.
+    struct timespec remaining;
+    if (timeout) {
+        remaining = *timeout;
+    }
+
+    for (;;) {
+        const ssize_t rc = flush_or_park(lg, 1, timeout ? &remaining : NULL);
+        if (rc < 0) {
+            return (int)rc;
+        }
+
+        if (lg->durable > offset) {
+            return 0;
+        }
+
+        if (timeout && !deadline_remaining(&deadline, &remaining)) {
+            return ELTMOUT;
+        }
+    }
+}
+
+static int flush_in_worker(mqlog_t* lg,
+                           uint64_t offset,
+                           const struct timespec* timeout) {
+    struct timespec deadline;
+    if (timeout) {
+        start_deadline(timeout, &deadline);
+    }
+
+    if (pthread_mutex_lock(&lg->sync_lock) != 0) {
+        return ELLCKOP;
+    }
+
+    // A flush in progress may miss the frame: flushes are requested
+    // until one covers it.
+    int rc = 0;
+    while (rc == 0 && lg->durable <= offset) {
+        // Registered before the flush, as in `flush_or_park`.
+        __sync_add_and_fetch(&lg->read_waiters, 1);
+        const uint32_t published = lg->published;
+        const uint64_t durable = lg->durable;
+        const uint64_t done = lg->flushes_done;
+        request_task(lg, TASK_SYNC);
+
+        int err = 0;
+        while (err == 0 && lg->flushes_done == done) {
+            err = timeout ?
+                pthread_cond_timedwait(&lg->flushed, &lg->sync_lock,
+                                       &deadline) :
+                pthread_cond_wait(&lg->flushed, &lg->sync_lock);
+        }
+
+        if (lg->flushes_done != done && lg->flush_result < 0) {
+            rc = (int)lg->flush_result;
+        } else if (err != 0) {
+            rc = err == ETIMEDOUT ? ELTMOUT : ELLCKOP;
+        }
+
+        // No progress: the worker isn't asked to flush again before
+        // the frames claimed by other producers are written.
+        struct timespec remaining;
+        if (rc == 0 && lg->durable == durable) {
+            if (timeout && !deadline_remaining(&deadline, &remaining)) {
+                rc = ELTMOUT;
+            } else {
+                pthread_mutex_unlock(&lg->sync_lock);
+                futex_wait(&lg->published, published,
+                           timeout ? &remaining : NULL);
+                pthread_mutex_lock(&lg->sync_lock);
+            }
+        }
+        __sync_sub_and_fetch(&lg->read_waiters, 1);
+    }
+
+    if (pthread_mutex_unlock(&lg->sync_lock) != 0) {
+        return ELLCKOP;
+    }
+
+    return lg->durable > offset ? 0 : rc;
+}
+
+int mqlog_wait_durable(mqlog_t* lg,
+                       uint64_t offset,
+                       const struct timespec* timeout) {
+    if (lg->durable > offset) {
+        return 0;
+    }
+
+    // Producers don't block on disk when a worker is running.
+    return lg->worker ? flush_in_worker(lg, offset, timeout) :
+                        flush_in_caller(lg, offset, timeout);
 }
@@ -2,21 +2,160 @@
 #define MQLOG_MQLOG_H_
 
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <prot.h>
 #include <mqlogerrno.h>
 
 #define MQLOG_RDDRT 0x0
 #define MQLOG_RDCMT 0x1
+#define MQLOG_WRBLK 0x2  // writes wait for segment rolls instead of ELLOCK
+#define MQLOG_PREPARE 0x4  // next segment is prepared in the background
+#define MQLOG_PREFAULT 0x8  // pages are populated ahead of producers
+#define MQLOG_RECOVER 0x10  // frames not synced are checked on open
+#define MQLOG_EVENTFD 0x20  // readers can be notified through an eventfd
+// Frames are staged in memory and written to the segment files with
+// pwrite when synced, instead of being written back by the kernel:
+// frames not synced yet are lost if the process crashes.
+#define MQLOG_PWRITE 0x40
+#define MQLOG_DIRECT 0x80  // MQLOG_PWRITE with O_DIRECT, where supported
+#define MQLOG_RECYCLE 0x100  // files of expired segments are reused
+
+// Sync policies
+#define MQLOG_SYNC_NONE     0x0  // on `mqlog_sync` only
+#define MQLOG_SYNC_WRITE    0x1  // writes return once synced, one by one
+#define MQLOG_SYNC_GROUP    0x2  // same, concurrent syncs are coalesced
+#define MQLOG_SYNC_INTERVAL 0x3  // in the background, every interval
+#define MQLOG_SYNC_BYTES    0x4  // in the background, every bytes written
 
 typedef struct mqlog mqlog_t;
+typedef struct mqlog_reader mqlog_reader_t;
+
+// A frame claimed by `mqlog_reserve`: its payload is written in place
+// and becomes visible to readers after `mqlog_commit`.
+struct mqlog_ticket {
+    void*    sgm;       // segment the frame belongs to
+    uint64_t offset;    // offset assigned to the frame
+    uint32_t position;  // physical offset of the frame in the segment
+    uint32_t size;      // payload size
+};
+
+typedef struct mqlog_ticket mqlog_ticket_t;
+
+// A consumer reading frames in order: the segment and the position
+// of the next frame are kept between reads. A cursor is not thread safe.
+struct mqlog_cursor {
+    mqlog_t* lg;
+    void*    sgm;       // segment of the next frame
+    uint64_t base;      // base offset of `sgm`
+    uint64_t offset;    // offset of the next frame
+    uint32_t position;  // physical offset of the next frame, 0 until known
+    void*    reader;    // read section of the cursor, if any
+    int      hold;      // the section is held between calls
+};
+
+typedef struct mqlog_cursor mqlog_cursor_t;
+
+struct mqlog_options {
+    unsigned int flags;
+    // MQLOG_PREPARE: percentage of the active segment written
+    // before the next segment is prepared.
+    unsigned int prepare_threshold;
+    // MQLOG_PREFAULT: bytes populated ahead of the write offset,
+    // rounded down to a multiple of the page size.
+    size_t       prefault_window;
+    // Frames per index entry of new segments: lookups scan at most
+    // `index_interval - 1` frame headers.
+    unsigned int index_interval;
+    // Sealed segments are mapped when read. Beyond these limits,
+    // 0 for none, the least recently read ones are unmapped: frames
+    // read from them outside of a read section must not be used
+    // anymore.
+    size_t       max_mapped_segments;
+    size_t       max_mapped_bytes;
+    // The oldest sealed segments are deleted in the background beyond
+    // these limits, 0 for none: reading their offsets fails with
+    // ELOSLOW, frames read from them outside of a read section must
+    // not be used anymore.
+    size_t       max_retained_segments;
+    size_t       max_retained_bytes;
+    unsigned int max_segment_age_ms;
+    // MQLOG_RECYCLE: expired segments kept for new segments, beyond
+    // which their files are deleted.
+    size_t       max_pooled_segments;
+    // When frames are synced, see MQLOG_SYNC_*. Concurrent writers
+    // get ELLOCK while another one rolls the segment unless
+    // MQLOG_WRBLK is set, which MQLOG_SYNC_GROUP usually wants.
+    unsigned int sync_policy;
+    unsigned int sync_interval_ms;
+    size_t       sync_bytes;
+    // Called by the flushing thread whenever the durable offset moves
+    // forward, with the new offset. Must not call `mqlog_sync`.
+    void       (*on_durable)(uint64_t, void*);
+    void*        on_durable_arg;
+};
+
+/* sets the default options, flags are cleared */
+void    mqlog_options_init(struct mqlog_options*);
 
 /* non thread safe functions */
 int     mqlog_open(mqlog_t**, const char*, size_t, unsigned int);
+int     mqlog_open_options(mqlog_t**,
+                           const char*,
+                           size_t,
+                           const struct mqlog_options*);
 int     mqlog_close(mqlog_t*);
 
 /* thread safe functions */
 ssize_t mqlog_write(mqlog_t*, const void*, size_t);
+/* empty payloads are skipped: the offset of the first frame written
+ * is stored, if any */
+ssize_t mqlog_writev(mqlog_t*, const struct iovec*, int, uint64_t*);
+int     mqlog_reserve(mqlog_t*, size_t, void**, mqlog_ticket_t*);
+ssize_t mqlog_commit(mqlog_t*, const mqlog_ticket_t*, uint64_t*);
+/* returns without waiting for the sync policy, with the frame offset */
+ssize_t mqlog_write_async(mqlog_t*, const void*, size_t, uint64_t*);
 ssize_t mqlog_read(mqlog_t*, uint64_t, struct frame*);
-ssize_t mqlog_sync(const mqlog_t*);
+/* reads the frames of a segment from an offset, up to a number of
+ * frames and of payload bytes, at least one: returns the number
+ * of frames read */
+ssize_t mqlog_readv(mqlog_t*, uint64_t, struct frame*, size_t, size_t);
+/* waits for the frame at the offset to be written, forever
+ * without timeout: ELNORD once the timeout expires */
+ssize_t mqlog_read_wait(mqlog_t*,
+                        uint64_t,
+                        struct frame*,
+                        const struct timespec*);
+/* MQLOG_EVENTFD: the eventfd becomes readable after `mqlog_arm`, once
+ * a frame is written. Returns 1 if the offset can already be read */
+int     mqlog_eventfd(const mqlog_t*);
+int     mqlog_arm(mqlog_t*, uint64_t);
+/* read sections, not nested: frames read in a section stay valid
+ * until it's left, even if their segment is unmapped. A reader is
+ * used by one thread at a time, up to 64 per log */
+int     mqlog_reader_open(mqlog_t*, mqlog_reader_t**);
+void    mqlog_reader_close(mqlog_reader_t*);
+void    mqlog_enter(mqlog_reader_t*);
+void    mqlog_exit(mqlog_reader_t*);
+/* the cursor is positioned at the offset given. It has its own read
+ * section, left before every call returns: like frames read outside
+ * of a section, frames must not be used once their segment is
+ * unmapped. ELRDSLT if no reader is left, the cursor pins segments
+ * on every read then */
+int     mqlog_cursor_init(mqlog_t*, uint64_t, mqlog_cursor_t*);
+/* the section is held after a frame is read: it stays valid until
+ * the next call, even if its segment is unmapped. Meanwhile unmapped
+ * segments are not reclaimed */
+void    mqlog_cursor_hold(mqlog_cursor_t*);
+void    mqlog_cursor_close(mqlog_cursor_t*);
+/* reads the frame at the cursor offset, then moves to the next one */
+ssize_t mqlog_cursor_next(mqlog_cursor_t*, struct frame*);
+/* concurrent calls are coalesced into one flush of every segment */
+ssize_t mqlog_sync(mqlog_t*);
+/* frames below the offset returned are synced */
+uint64_t mqlog_durable_offset(const mqlog_t*);
+/* waits for the frame at the offset to be synced, by the background
+ * worker if any: ELTMOUT once the timeout expires */
+int     mqlog_wait_durable(mqlog_t*, uint64_t, const struct timespec*);
 
 #endif
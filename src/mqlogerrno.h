@@ -32,5 +32,12 @@
 #define ELIDXPC -29 // index operation panic
 #define ELIDXLK -30 // index is locked
 #define ELIDXNM -31 // key inserted violates monotonicity
+#define ELWRKCR -32 // background worker operation failed
+#define ELUNMAP -33 // segment not mapped
+#define ELMNFST -34 // manifest missing or invalid
+#define ELLOST  -35 // offset lost, truncated by a recovery
+#define ELEVTFD -36 // eventfd not available
+#define ELTMOUT -37 // timed out
+#define ELRDSLT -38 // no reader slot left
 
 #endif
@@ -1,10 +1,12 @@
 #include "prot.h"
+#include "crc32.h"
+#include "crc32c.h"
 
 void header_init(struct header* hdr) {
     // TODO: address endianess
     hdr->flags = HEADER_FLAGS_EMPTY;
     hdr->version = HEADER_VERSION;
-    hdr->pad = HEADER_PAD;
+    hdr->checksum = HEADER_CHECKSUM_CRC32C;
 }
 
 size_t frame_payload_size(const struct frame* fr) {
@@ -21,3 +23,16 @@ int prot_is_header(void* ptr) {
 
     return 0;
 }
+
+int frame_verify(const struct frame* fr) {
+    const size_t size = frame_payload_size(fr);
+    switch (fr->hdr->checksum) {
+        case HEADER_CHECKSUM_CRC32:
+            return crc32(0, fr->buffer, size) == fr->hdr->crc32;
+
+        case HEADER_CHECKSUM_CRC32C:
+            return crc32c(0, fr->buffer, size) == fr->hdr->crc32;
+    }
+
+    return 0;
+}
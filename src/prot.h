@@ -11,11 +11,11 @@
 // | 4 bytes ......................... |
 //
 // |--------|--------|--------|--------|
-// | Flags           |Version |Padding |
+// | Flags           |Version |Chksum  |
 // |--------|--------|--------|--------|
 // | Frame size (incl header)          |
 // |-----------------------------------|
-// | CRC32                             |
+// | Checksum                          |
 // |-----------------------------------|
 // End of header
 // |--------|--------|--------|--------|
@@ -26,7 +26,11 @@
 struct header {
     volatile uint16_t flags;
     uint8_t  version;
-    uint8_t  pad; // not used
+    // Algorithm used for `crc32`, formerly the `pad` byte.
+    __extension__ union {
+        uint8_t checksum;
+        uint8_t pad;
+    };
     uint32_t size;
     uint32_t crc32;
 };
@@ -44,7 +48,12 @@ struct header {
 
 #define HEADER_VERSION     0x0
 
-#define HEADER_PAD         0x0
+#define HEADER_PAD         0x0  // same as HEADER_CHECKSUM_CRC32
+
+// Checksum algorithms. The byte was padding in the first frames,
+// always zero: those frames are checked with CRC32.
+#define HEADER_CHECKSUM_CRC32  0x0
+#define HEADER_CHECKSUM_CRC32C 0x1
 
 
 struct frame {
@@ -59,4 +68,7 @@ size_t frame_payload_size(const struct frame*);
 
 int prot_is_header(void*);
 
+/* returns 1 if the payload matches the checksum of the header */
+int frame_verify(const struct frame*);
+
 #endif
@@ -1,7 +1,8 @@
+#define _GNU_SOURCE  // needed for `fallocate`
 #include "segment.h"
 #include "prot.h"
 #include "util.h"
-#include "crc32.h"
+#include "crc32c.h"
 #include "mqlogerrno.h"
 #include "cassert.h"
 #include <string.h>
@@ -11,14 +12,31 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <stdio.h>
 #include <errno.h>
 #include <assert.h>
 
 #define DATA_SUFFIX  "log"
 #define INDEX_SUFFIX "idx"
+#define SPARE_SUFFIX "spare"
+#define POOL_SUFFIX  "pool"
 
-#define LATEST_SEGMENT_VERSION 0
+enum { PATH_SIZE = 256 };
+enum { PREFETCH_DISTANCE = 8 };  // frames
+
+// `state` of a segment: the files are mapped, the lower bits count
+// the readers which prevent the segment from being unmapped.
+#define SGM_MAPPED 0x80000000u
+
+// Version 0: dense index, one 8 bytes entry per frame.
+// Version 1: the index starts with an `index_header`, followed by
+// the 4 bytes position of one frame every `interval` frames.
+#define SEGMENT_VERSION_DENSE  0
+#define SEGMENT_VERSION_SPARSE 1
+#define LATEST_SEGMENT_VERSION SEGMENT_VERSION_SPARSE
+
+#define INDEX_MAGIC 0x5844494d  // "MIDX"
 
 #define CRC32_INIT 0
 
@@ -26,6 +44,13 @@ struct index_entry {
     volatile size_t physical_offset;
 };
 
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t interval;  // frames per index entry
+    uint32_t reserved;
+};
+
 struct offset_pair {
     uint32_t index;
     uint32_t data;
@@ -46,14 +71,23 @@ struct segment {
     // It is required to be the first 4 bytes of the struct.
     unsigned int                   version;
     unsigned int                   flags;
-    int                            index_fd;      // index file descriptor
-    int                            data_fd;       // segment file descriptor
     uint32_t                       size;          // size of the segment in bytes
     uint64_t                       base_offset;   // base offset of the segment
     volatile unsigned char*        buffer;
-    volatile struct index_entry*   index;
+    volatile unsigned char*        index_map;     // mapped index file
+    size_t                         index_size;    // index file size
+    volatile struct index_entry*   index;         // version 0 entries
+    volatile uint32_t*             positions;     // version 1 entries
+    uint32_t                       interval;      // frames per entry
+    uint32_t                       capacity;      // frames indexable
     volatile struct offset_pair    s_offset_pair; // sync (to disk) offset
     volatile union cas_offset_pair w_offset_pair;
+    volatile union cas_offset_pair r_offset_pair; // frames below are ready
+    volatile uint32_t              faulted;       // pre-faulted up to
+    volatile uint32_t              state;         // mapped bit | readers
+    volatile int                   referenced;    // read since last sweep
+    char                           index_path[PATH_SIZE];
+    char                           data_path[PATH_SIZE];
 };
 
 static int index_filename(char filename[], size_t len, uint64_t offset) {
@@ -66,75 +100,50 @@ static int data_filename(char filename[], size_t len, uint64_t offset) {
     return n <= (int)len ? 0 : -1;
 }
 
-static int open_index(const char* dir, uint64_t offset, size_t size) {
-    const size_t len0 = 64;
-    char filename[len0];
-    if (index_filename(filename, len0, offset) == -1) {
-        return ELSOFLW;
-    }
+static int spare_filename(char filename[], size_t len, const char* suffix) {
+    // Doesn't end with the data suffix: spare segments are not
+    // loaded as part of the log.
+    int n = snprintf(filename, len, "%s.%s", suffix, SPARE_SUFFIX);
+    return n <= (int)len ? 0 : -1;
+}
+
+static int pool_filename(char filename[],
+                         size_t len,
+                         uint64_t id,
+                         const char* suffix) {
+    // Doesn't end with the data suffix either.
+    int n = snprintf(filename, len, "%jd.%s.%s", id, suffix, POOL_SUFFIX);
+    return n <= (int)len ? 0 : -1;
+}
 
+static int set_paths(struct segment* sgm,
+                     const char* dir,
+                     const char* index_file,
+                     const char* data_file) {
     if (ensure_directory(dir) != 0) {
         return ELFLEOP;
     }
 
-    const size_t len1 = 256;
-    char file[len1];
-    if (append_file_to_dir(file, len1, dir, filename) == -1) {
+    // paths contain the fullpath of the segment files
+    if (append_file_to_dir(sgm->index_path,
+                           PATH_SIZE,
+                           dir,
+                           index_file) == -1) {
         return ELSOFLW;
     }
 
-    // file contains the fullpath of the segment file
-    int fd = open(file,
-                  O_RDWR | O_CREAT,
-                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-    if (fd < 0) {
-        return ELFLEOP;
-    }
-
-    struct stat file_stat;
-    if (fstat(fd, &file_stat) < 0) {
-        goto error;
-    }
-
-    size_t file_size = file_stat.st_size;
-    if (file_size > 0 && file_size != size) {
-        goto error;
-    }
-
-    if (file_size == 0) {
-        if (ftruncate(fd, size) < 0) {
-            goto error;
-        }
-    }
-
-    return fd;
-
-error:
-    if (fd > 0) {
-        close(fd);
-    }
-
-    return ELFLEOP;
-}
-
-static int open_data(const char* dir, uint64_t offset, size_t size) {
-    const size_t len0 = 64;
-    char filename[len0];
-    if (data_filename(filename, len0, offset) == -1) {
+    if (append_file_to_dir(sgm->data_path,
+                           PATH_SIZE,
+                           dir,
+                           data_file) == -1) {
         return ELSOFLW;
     }
 
-    if (ensure_directory(dir) != 0) {
-        return ELFLEOP;
-    }
-
-    const size_t len1 = 256;
-    char file[len1];
-    if (append_file_to_dir(file, len1, dir, filename) == -1) {
-        return ELSOFLW;
-    }
+    return 0;
+}
 
-    // file contains the fullpath of the segment file
+static int open_file(const char* file, size_t size) {
+    // The file will be created if it does not exist.
     int fd = open(file,
                   O_RDWR | O_CREAT,
                   S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
@@ -168,15 +177,15 @@ error:
     return ELFLEOP;
 }
 
-static int mmap_helper(void** ptr, size_t size, int fd) {
+static int mmap_helper(void** ptr, size_t size, int fd, int shared) {
     // TODO: maybe mapping the whole file is not necessary.
     void* ptr0 = mmap(0,
                       size,
                       PROT_READ | PROT_WRITE,
-                      MAP_SHARED,
+                      shared ? MAP_SHARED : MAP_PRIVATE,
                       fd,
                       0);
-    if (!ptr0) {
+    if (ptr0 == MAP_FAILED) {
         return ELMMAP;
     }
 
@@ -190,42 +199,128 @@ static int mmap_helper(void** ptr, size_t size, int fd) {
     return 0;
 }
 
-static int find_w_offset_pair(struct offset_pair* w_offset_pair,
-                              volatile const unsigned char* buffer,
-                              volatile const struct index_entry* index,
-                              size_t size) {
-
-    // size if index buffer size, not the number of index entries
-    const size_t max_index_entries = size / sizeof(struct index_entry);
-
-    size_t prev_physical_offset = 0;
-    const struct header* prev_hdr = NULL;
-    size_t i = 0;
-    for (; i < max_index_entries; ++i) {
-        if (index[i].physical_offset == 0) {
-            if (!(i == 0 && prot_is_header((void*)buffer))) {
-                size_t offset = 0;
-                if (i != 0) {
-                    prev_hdr =
-                        (const struct header*)&buffer[prev_physical_offset];
-                    offset = prev_hdr->size;
-                }
-                w_offset_pair->index = i;
-                w_offset_pair->data = prev_physical_offset + offset;
-                return 0;
-            }
+static void walk_frames_to(struct offset_pair* pair,
+                           volatile const unsigned char* buffer,
+                           uint32_t data_size,
+                           uint32_t limit) {
+    const size_t header_size = sizeof(struct header);
+
+    // Moves `pair` after the ready frames following it, up to the
+    // frame `limit`.
+    uint32_t index = pair->index;
+    size_t position = pair->data;
+    while (position + header_size <= data_size) {
+        const volatile struct header* hdr =
+            (const volatile struct header*)&buffer[position];
+        if (hdr->flags == HEADER_FLAGS_EOS) {
+            // A sealed segment ends with an EOS frame, which
+            // claimed all the space left in the segment.
+            position = data_size;
+            break;
+        }
+
+        if (index >= limit ||
+            hdr->flags != HEADER_FLAGS_READY ||
+            hdr->size < header_size ||
+            position + hdr->size > data_size) {
+            break;
+        }
+
+        position += hdr->size;
+        ++index;
+    }
+
+    pair->index = index;
+    pair->data = position;
+}
+
+static void walk_frames(struct offset_pair* pair,
+                        volatile const unsigned char* buffer,
+                        uint32_t data_size) {
+    walk_frames_to(pair, buffer, data_size, UINT32_MAX);
+}
+
+static uint32_t entry_position(const segment_t* sgm, uint32_t entry) {
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        return sgm->index[entry].physical_offset;
+    }
+
+    return sgm->positions[entry];
+}
+
+static uint32_t indexed_frames(const segment_t* sgm, uint32_t synced) {
+    // Producers publish index entries out of order: a crash can leave
+    // holes, after the `synced` frames only. Frames from the first hole
+    // on can't be looked up, they are dropped. Only the first frame
+    // can be at position zero.
+    const uint32_t entries = sgm->capacity / sgm->interval;
+    const uint32_t from = max((synced + sgm->interval - 1) / sgm->interval,
+                              1);
+
+    // Written entries are followed by zeros but for the holes: a zero
+    // entry is found with a binary search, which only faults a few
+    // pages of the index in. Entries before it are then checked from
+    // the synced ones on.
+    uint32_t lo = min(from, entries);
+    uint32_t hi = entries;
+    while (lo < hi) {
+        const uint32_t mid = lo + (hi - lo) / 2;
+        if (entry_position(sgm, mid) != 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
-        prev_physical_offset = index[i].physical_offset;
     }
 
-    return ELWOFFS;
+    uint32_t entry = min(from, lo);
+    while (entry < lo && entry_position(sgm, entry) != 0) {
+        ++entry;
+    }
+
+    return entry * sgm->interval;
+}
+
+static int frame_at(const segment_t* sgm, uint32_t position) {
+    const size_t header_size = sizeof(struct header);
+    if (position + header_size > sgm->size) {
+        return 0;
+    }
+
+    const volatile struct header* hdr =
+        (const volatile struct header*)&sgm->buffer[position];
+    return hdr->flags == HEADER_FLAGS_READY ||
+           hdr->flags == HEADER_FLAGS_EOS;
+}
+
+static void find_w_offset_pair(segment_t* sgm,
+                               struct offset_pair* w_offset_pair) {
+    // Without a checkpoint the whole index is checked, the data only
+    // from the last entry before the first hole: frames whose entry
+    // was published before their header are skipped backwards.
+    const uint32_t limit = indexed_frames(sgm, 0);
+    uint32_t entry = limit / sgm->interval - 1;
+    while (entry > 0 && !frame_at(sgm, entry_position(sgm, entry))) {
+        --entry;
+    }
+
+    w_offset_pair->index = entry * sgm->interval;
+    w_offset_pair->data = entry_position(sgm, entry);
+    walk_frames_to(w_offset_pair, sgm->buffer, sgm->size, limit);
 }
 
 static size_t calculate_index_size(size_t data_size) {
-    // implements `ceil` function
+    // Size of version 0 index files: too small for segments full of
+    // tiny frames, whose capacity is limited to the entries it holds.
     return (data_size + 1) / sizeof(struct header);
 }
 
+static uint32_t calculate_index_entries(uint32_t data_size,
+                                        uint32_t interval) {
+    // The smallest frame has a one byte payload.
+    const uint32_t max_frames = data_size / (sizeof(struct header) + 1);
+    return (max_frames + interval - 1) / interval;
+}
+
 static int claim(segment_t* sgm,
                  struct offset_pair old,
                  struct offset_pair new) {
@@ -251,13 +346,58 @@ static int claim(segment_t* sgm,
     return 0;
 }
 
+static union cas_offset_pair load_w_offset_pair(const segment_t* sgm) {
+    // A single 8 byte load, the pair is never observed half updated.
+    const union cas_offset_pair pair = {
+        .cas_helper = sgm->w_offset_pair.cas_helper
+    };
+    return pair;
+}
+
+static struct offset_pair load_r_offset_pair(const segment_t* sgm) {
+    const union cas_offset_pair pair = {
+        .cas_helper = sgm->r_offset_pair.cas_helper
+    };
+    return pair.value;
+}
+
+static void advance_ready(segment_t* sgm) {
+    // Orders the flags stored by this producer before the flags
+    // loaded: of two producers finishing at the same time, at
+    // least one sees the frame of the other.
+    __sync_synchronize();
+
+    for (;;) {
+        const union cas_offset_pair curr = {
+            .cas_helper = sgm->r_offset_pair.cas_helper
+        };
+
+        // Producers finishing out of order: the last one of a run of
+        // ready frames moves the watermark after all of them.
+        union cas_offset_pair next = curr;
+        walk_frames(&next.value, sgm->buffer, sgm->size);
+        if (next.cas_helper == curr.cas_helper ||
+            __sync_bool_compare_and_swap(&sgm->r_offset_pair.cas_helper,
+                                         curr.cas_helper,
+                                         next.cas_helper)) {
+            return;
+        }
+    }
+}
+
+static int sealed(const segment_t* sgm, struct offset_pair curr) {
+    // An EOS frame claims all the space left in the segment.
+    return curr.data == sgm->size;
+}
+
 static int mark_eos(segment_t* sgm, struct offset_pair curr) {
     const size_t header_size = sizeof(struct header);
 
-    // marking EOS does not increase index
+    // marking EOS does not increase index, but it claims the rest of
+    // the segment: no other frame can be inserted after it.
     const struct offset_pair new = {
         .index = curr.index,
-        .data = curr.data + header_size
+        .data = sgm->size
     };
 
     int rc = claim(sgm, curr, new);
@@ -273,28 +413,117 @@ static int mark_eos(segment_t* sgm, struct offset_pair curr) {
 
     // Mark segment as complete for writes.
     hdr->flags = HEADER_FLAGS_EOS;
+    advance_ready(sgm);
 
     return ELEOS;
 }
 
-static int marked_eos(const segment_t* sgm) {
-    const size_t header_size = sizeof(struct header);
-    const size_t w_offset = sgm->w_offset_pair.value.data;
-    if (w_offset < header_size) {
+static int pwrite_engine(const segment_t* sgm) {
+    return (sgm->flags & SGM_PWRITE) == SGM_PWRITE;
+}
+
+static int open_written(const char* path, int direct) {
+    int fd = -1;
+    if (direct) {
+        // Not supported by every filesystem.
+        fd = open(path, O_WRONLY | O_DIRECT);
+    }
+
+    return fd >= 0 ? fd : open(path, O_WRONLY);
+}
+
+static int pwrite_range(int fd,
+                        volatile const unsigned char* buffer,
+                        size_t from,
+                        size_t to) {
+    while (from < to) {
+        const ssize_t n = pwrite(fd, (const void*)(buffer + from),
+                                 to - from, from);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        from += n;
+    }
+
+    return 0;
+}
+
+static int write_back_file(const char* path,
+                           volatile const unsigned char* buffer,
+                           size_t size,
+                           int direct,
+                           size_t from,
+                           size_t to) {
+    // SGM_PWRITE: whole pages are written, from the staging mapping.
+    // Bytes of frames not ready yet are written again by the next
+    // write back, which starts at the same page.
+    from = page_aligned_addr(from);
+    to = min(page_aligned_addr(to + pagesize() - 1), size);
+    if (from >= to) {
         return 0;
     }
 
-    const uint64_t last_header_offset = w_offset - header_size;
+    int fd = open_written(path, direct);
+    if (fd < 0) {
+        return ELFLEOP;
+    }
+
+    int rc = pwrite_range(fd, buffer, from, to);
+    if (rc != 0 && direct && errno == EINVAL) {
+        // O_DIRECT requires aligned lengths: the segment size may
+        // not be a multiple of the block size.
+        close(fd);
+        fd = open_written(path, 0);
+        if (fd < 0) {
+            return ELFLEOP;
+        }
+        rc = pwrite_range(fd, buffer, from, to);
+    }
+
+    if (rc != 0 || fdatasync(fd) != 0) {
+        close(fd);
+        return ELDTSYN;
+    }
+    close(fd);
+
+    return 0;
+}
 
-    const struct header* hdr =
-       (const struct header*)(sgm->buffer + last_header_offset);
+static int write_back(const segment_t* sgm, size_t from, size_t to) {
+    const int direct = (sgm->flags & SGM_DIRECT) == SGM_DIRECT;
+    return write_back_file(sgm->data_path, sgm->buffer, sgm->size,
+                           direct, from, to);
+}
 
-    return hdr->flags == HEADER_FLAGS_EOS;
+static int write_back_index(const segment_t* sgm, size_t from, size_t to) {
+    // The index is small and rarely block aligned: no O_DIRECT.
+    return write_back_file(sgm->index_path, sgm->index_map,
+                           sgm->index_size, 0, from, to);
 }
 
-static int sync_data(segment_t* sgm) {
+static int sync_data(segment_t* sgm, struct offset_pair ready) {
+    if (pwrite_engine(sgm)) {
+        const size_t from = sgm->s_offset_pair.data;
+        if (ready.data == from) {
+            return 0;
+        }
+
+        const int rc = write_back(sgm, from, ready.data);
+        if (rc != 0) {
+            return rc;
+        }
+        sgm->s_offset_pair.data = ready.data;
+
+        // returns size in bytes of the synced area
+        return ready.data - from;
+    }
+
+    // Frames claimed but not written yet are synced later.
     const void* addr = (void*)&sgm->buffer[sgm->s_offset_pair.data];
-    const size_t w_offset = sgm->w_offset_pair.value.data;
+    const size_t w_offset = ready.data;
     const size_t size = w_offset - sgm->s_offset_pair.data;
 
     // addr needs to be a multiple of pagesize for msync to work.
@@ -312,11 +541,44 @@ static int sync_data(segment_t* sgm) {
     return sync_size;
 }
 
-static int sync_index(segment_t* sgm) {
-    const void* addr = (const void*)&sgm->index[sgm->s_offset_pair.index];
-    const size_t w_index = sgm->w_offset_pair.value.index;
+static volatile void* index_entry_addr(const segment_t* sgm,
+                                       uint32_t index) {
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        return &sgm->index[index];
+    }
+
+    return &sgm->positions[index / sgm->interval];
+}
+
+static int sync_index(segment_t* sgm, struct offset_pair ready) {
+    const size_t w_index = ready.index;
     const size_t length = w_index - sgm->s_offset_pair.index;
-    const size_t size = sizeof(struct index_entry) * length;
+    if (length == 0) {
+        return 0;
+    }
+
+    // From the entry of the first frame to sync to the entry
+    // of the last one, both included.
+    const size_t entry_size = sgm->version == SEGMENT_VERSION_DENSE ?
+        sizeof(struct index_entry) : sizeof(uint32_t);
+    const void* addr =
+        (const void*)index_entry_addr(sgm, sgm->s_offset_pair.index);
+    const void* last = (const void*)index_entry_addr(sgm, w_index - 1);
+    const size_t size = (size_t)last + entry_size - (size_t)addr;
+
+    // SGM_PWRITE: the index mapping is private too, its entries are
+    // written back after the data they point to.
+    if (pwrite_engine(sgm)) {
+        const size_t from = (size_t)addr - (size_t)sgm->index_map;
+        const int rc = write_back_index(sgm, from, from + size);
+        if (rc != 0) {
+            return rc;
+        }
+        sgm->s_offset_pair.index = w_index;
+
+        // returns number of index entries synced
+        return length;
+    }
 
     // addr needs to be a multiple of pagesize for msync to work.
     void* sync_addr = (void*)page_aligned_addr((size_t)addr);
@@ -332,174 +594,914 @@ static int sync_index(segment_t* sgm) {
     return length;
 }
 
-int segment_open(segment_t** sgm_ptr,
-                 const char* dir,
-                 uint64_t base_offset,
-                 uint32_t size,  // segment max size: 4GB
-                 unsigned int flags) {
-    // Size has to be a multiple of page size.
-    if (size % pagesize() != 0) {
-        return ELNOPGM;
+static ssize_t sync_segment(segment_t* sgm) {
+    const struct offset_pair ready = load_r_offset_pair(sgm);
+    ssize_t size = sync_data(sgm, ready);
+    if (size <= 0) {
+        return size;
     }
 
+    return sync_index(sgm, ready);
+}
+
+static struct segment* alloc_segment(uint32_t size,
+                                     unsigned int flags,
+                                     uint32_t interval) {
     struct segment* sgm = (struct segment*)malloc(sizeof(struct segment));
     if (!sgm) {
-        return ELALLC;
+        return NULL;
     }
 
     // Initialize segment struct
     memset(sgm, 0, sizeof(struct segment));
-    sgm->base_offset = base_offset;
+    sgm->size = size;
+    sgm->flags = flags;
+    sgm->version = LATEST_SEGMENT_VERSION;
+    sgm->interval = interval > 0 ? interval : 1;
+
+    return sgm;
+}
 
-    // The index will contain one entry for each entry in the segment
-    // TODO: use sparse index
-    const size_t index_size = calculate_index_size(size);
+static void unmap_files(struct segment* sgm) {
+    munmap((void*)sgm->buffer, sgm->size);
+    munmap((void*)sgm->index_map, sgm->index_size);
+}
 
-    // The file will be created if it does
-    // not exist.
-    int index_fd = open_index(dir, base_offset, index_size);
-    if (index_fd < 0) {
-        free(sgm);
-        return index_fd;
+static int read_index_header(int fd, struct index_header* hdr) {
+    const ssize_t n = pread(fd, hdr, sizeof(struct index_header), 0);
+    if (n != sizeof(struct index_header)) {
+        return ELFLEOP;
+    }
+
+    return 0;
+}
+
+static int open_index(struct segment* sgm) {
+    const size_t header_size = sizeof(struct index_header);
+    const size_t entry_size = sizeof(uint32_t);
+
+    // The format of existing index files is kept, the configured
+    // interval only applies to new segments.
+    struct index_header hdr;
+    const ssize_t existing_size = file_exists(sgm->index_path) ?
+        file_size(sgm->index_path) : 0;
+    if (existing_size > 0) {
+        int fd = open(sgm->index_path, O_RDONLY);
+        if (fd < 0) {
+            return ELFLEOP;
+        }
+
+        const int rc = read_index_header(fd, &hdr);
+        close(fd);
+        if (rc != 0 ||
+            hdr.magic != INDEX_MAGIC ||
+            hdr.version != SEGMENT_VERSION_SPARSE ||
+            hdr.interval == 0) {
+            // The first entry of a version 0 index is always zero.
+            sgm->version = SEGMENT_VERSION_DENSE;
+            sgm->interval = 1;
+        } else {
+            sgm->version = SEGMENT_VERSION_SPARSE;
+            sgm->interval = hdr.interval;
+        }
+    }
+
+    uint32_t entries = 0;
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        sgm->index_size = calculate_index_size(sgm->size);
+        sgm->capacity = sgm->index_size / sizeof(struct index_entry);
+    } else {
+        entries = calculate_index_entries(sgm->size, sgm->interval);
+        sgm->index_size = header_size + entries * entry_size;
+        sgm->capacity = entries * sgm->interval;
     }
 
-    sgm->index_fd = index_fd;
+    int fd = open_file(sgm->index_path, sgm->index_size);
+    if (fd < 0) {
+        return fd;
+    }
 
-    int rc = mmap_helper((void**)&sgm->index, index_size, sgm->index_fd);
+    // SGM_PWRITE: like the data, index entries are staged in memory.
+    // The kernel can't write them back before the frames they point
+    // to, which would leave entries past the end of the data.
+    int rc = mmap_helper((void**)&sgm->index_map, sgm->index_size, fd,
+                         !pwrite_engine(sgm));
+    if (rc != 0) {
+        close(fd);
+        return rc;
+    }
+
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        close(fd);
+        sgm->index = (volatile struct index_entry*)sgm->index_map;
+        return 0;
+    }
+
+    sgm->positions = (volatile uint32_t*)(sgm->index_map + header_size);
+
+    if (existing_size <= 0) {
+        hdr.magic = INDEX_MAGIC;
+        hdr.version = SEGMENT_VERSION_SPARSE;
+        hdr.interval = sgm->interval;
+        hdr.reserved = 0;
+        memcpy((void*)sgm->index_map, &hdr, header_size);
+
+        // A private mapping is not written back: the header is
+        // written to the file, or the index reads as dense.
+        if (pwrite_engine(sgm) &&
+            pwrite(fd, &hdr, header_size, 0) != (ssize_t)header_size) {
+            close(fd);
+            munmap((void*)sgm->index_map, sgm->index_size);
+            return ELFLEOP;
+        }
+    }
+
+    // The mapping is all that's needed.
+    close(fd);
+    return 0;
+}
+
+static int map_files(struct segment* sgm) {
+    int rc = open_index(sgm);
     if (rc != 0) {
-        close(sgm->index_fd);
-        free(sgm);
         return rc;
     }
 
     // The data file is the actual segment file.
-    int data_fd = open_data(dir, base_offset, size);
+    const int created = !file_exists(sgm->data_path);
+    int data_fd = open_file(sgm->data_path, sgm->size);
     if (data_fd < 0) {
-        close(sgm->index_fd);
-        munmap((void*)sgm->index, index_size);
-        free(sgm);
+        munmap((void*)sgm->index_map, sgm->index_size);
         return data_fd;
     }
 
-    sgm->data_fd = data_fd;
+    // SGM_PWRITE: the blocks are allocated upfront, a full disk fails
+    // here or on `pwrite` rather than with SIGBUS on a page fault.
+    if (created && pwrite_engine(sgm) &&
+        fallocate(data_fd, 0, 0, sgm->size) != 0 &&
+        errno == ENOSPC) {
+        close(data_fd);
+        unlink(sgm->data_path);
+        munmap((void*)sgm->index_map, sgm->index_size);
+        return ELFLEOP;
+    }
 
-    // Map the segment file into memory.
-    rc = mmap_helper((void**)&sgm->buffer, size, sgm->data_fd);
+    // Map the segment file into memory. File descriptors are not kept,
+    // they would limit the number of segments.
+    // SGM_PWRITE: the mapping is private, frames written to it are
+    // staged in memory until written back.
+    rc = mmap_helper((void**)&sgm->buffer, sgm->size, data_fd,
+                     !pwrite_engine(sgm));
+    close(data_fd);
     if (rc != 0) {
-        close(sgm->data_fd);
-        close(sgm->index_fd);
-        munmap((void*)sgm->index, index_size);
-        free(sgm);
+        munmap((void*)sgm->index_map, sgm->index_size);
         return rc;
     }
 
-    sgm->size = size;
-    sgm->flags = flags;
-    sgm->version = LATEST_SEGMENT_VERSION;
+    return 0;
+}
 
-    struct offset_pair w_offset_pair;
-    rc = find_w_offset_pair(&w_offset_pair,
-                            sgm->buffer,
-                            sgm->index,
-                            index_size);
+int segment_register(segment_t** sgm_ptr,
+                     const char* dir,
+                     uint64_t base_offset,
+                     uint32_t size,  // segment max size: 4GB
+                     unsigned int flags,
+                     uint32_t interval) {
+    // Size has to be a multiple of page size.
+    if (size % pagesize() != 0) {
+        return ELNOPGM;
+    }
+
+    struct segment* sgm = alloc_segment(size, flags, interval);
+    if (!sgm) {
+        return ELALLC;
+    }
+
+    sgm->base_offset = base_offset;
+
+    const size_t len = 64;
+    char index_file[len];
+    char data_file[len];
+    if (index_filename(index_file, len, base_offset) == -1 ||
+        data_filename(data_file, len, base_offset) == -1) {
+        free(sgm);
+        return ELSOFLW;
+    }
+
+    int rc = set_paths(sgm, dir, index_file, data_file);
     if (rc != 0) {
-        close(sgm->data_fd);
-        close(sgm->index_fd);
-        munmap((void*)sgm->index, index_size);
-        munmap((void*)sgm->buffer, size);
         free(sgm);
         return rc;
     }
 
+    *sgm_ptr = sgm;
+
+    return 0;
+}
+
+static int map_from(segment_t* sgm, const struct offset_pair* checkpoint) {
+    if (sgm->state & SGM_MAPPED) {
+        return 0;
+    }
+
+    int rc = map_files(sgm);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // A sealed segment keeps its write offsets once known, mapped
+    // before or given by `segment_set_final`: they don't move anymore.
+    const struct offset_pair known = load_w_offset_pair(sgm).value;
+    if (!checkpoint && sealed(sgm, known)) {
+        checkpoint = &known;
+    }
+
+    struct offset_pair w_offset_pair;
+    if (checkpoint &&
+        checkpoint->data <= sgm->size &&
+        checkpoint->index <= sgm->capacity) {
+        // Frames before the checkpoint have been synced: only the
+        // ones following it are checked.
+        // The index is only searched when frames follow it.
+        w_offset_pair = *checkpoint;
+        walk_frames(&w_offset_pair, sgm->buffer, sgm->size);
+        if (w_offset_pair.index != checkpoint->index) {
+            w_offset_pair = *checkpoint;
+            walk_frames_to(&w_offset_pair, sgm->buffer, sgm->size,
+                           indexed_frames(sgm, checkpoint->index));
+        }
+    } else {
+        find_w_offset_pair(sgm, &w_offset_pair);
+    }
+
     union cas_offset_pair cas_w_offset_pair = {
         .value = w_offset_pair
     };
 
     sgm->w_offset_pair = cas_w_offset_pair;
+    sgm->r_offset_pair = cas_w_offset_pair;
     sgm->s_offset_pair = cas_w_offset_pair.value;
+    sgm->faulted = 0;
 
-    *sgm_ptr = sgm;
+    // Readers can use the segment from now on.
+    __sync_synchronize();
+    sgm->state = SGM_MAPPED;
 
     return 0;
 }
 
-int segment_close(segment_t* sgm) {
-    int rc = segment_sync(sgm);
-    if (rc < 0) {
-        return rc;
-    }
-
-    // Reclaim all resources.
-    const size_t index_size = calculate_index_size(sgm->size);
-    munmap((void*)sgm->buffer, sgm->size);
-    munmap((void*)sgm->index, index_size);
-    close(sgm->data_fd);
-    close(sgm->index_fd);
-    free(sgm);
+int segment_map(segment_t* sgm) {
+    return map_from(sgm, NULL);
+}
 
-    // TODO: the directory may require fsyncing too.
+void segment_set_final(segment_t* sgm, uint32_t index, uint32_t data) {
+    // Only for segments not mapped yet.
+    const union cas_offset_pair pair = {
+        .value = {
+            .index = index,
+            .data = data
+        }
+    };
 
-    return 0;
+    sgm->w_offset_pair = pair;
+    sgm->r_offset_pair = pair;
+    sgm->s_offset_pair = pair.value;
 }
 
-// TODO: should be called `segment_base_offset`
-uint64_t segment_base_offset(const segment_t* sgm) {
-    return sgm->base_offset;
-}
+int segment_map_from(segment_t* sgm, uint32_t index, uint32_t data) {
+    const struct offset_pair checkpoint = {
+        .index = index,
+        .data = data
+    };
 
-uint64_t segment_write_offset(const segment_t* sgm) {
-    return sgm->base_offset + sgm->w_offset_pair.value.index;
+    return map_from(sgm, &checkpoint);
 }
 
-uint64_t segment_read_offset(const segment_t* sgm) {
-    // Only what has been written can be read.
-    return sgm->base_offset + sgm->w_offset_pair.value.index;
+static void rebuild_entry(segment_t* sgm, uint32_t index, size_t position) {
+    // Only entries missing or wrong are stored: pages stay clean.
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        if (sgm->index[index].physical_offset != position) {
+            sgm->index[index].physical_offset = position;
+        }
+    } else if (index % sgm->interval == 0 &&
+               sgm->positions[index / sgm->interval] != position) {
+        sgm->positions[index / sgm->interval] = position;
+    }
 }
 
-ssize_t segment_write(segment_t* sgm, const void* buf, size_t size) {
-    // First of all check if the segment is writable.
-    if (marked_eos(sgm)) {
-        return ELEOS;
+static void recover_frames(segment_t* sgm, struct offset_pair* pair) {
+    const size_t header_size = sizeof(struct header);
+
+    // Like `walk_frames`, the payloads are checked as well.
+    uint32_t index = pair->index;
+    size_t position = pair->data;
+    while (position + header_size <= sgm->size) {
+        const struct header* hdr =
+            (const struct header*)(sgm->buffer + position);
+        if (hdr->flags == HEADER_FLAGS_EOS) {
+            position = sgm->size;
+            break;
+        }
+
+        if (hdr->flags != HEADER_FLAGS_READY ||
+            hdr->size < header_size ||
+            position + hdr->size > sgm->size ||
+            index >= sgm->capacity) {
+            break;
+        }
+
+        const struct frame fr = {
+            .hdr = hdr,
+            .buffer = (const unsigned char*)hdr + header_size
+        };
+        if (!frame_verify(&fr)) {
+            break;
+        }
+
+        rebuild_entry(sgm, index, position);
+
+        position += hdr->size;
+        ++index;
     }
 
-    const struct offset_pair curr_w_offset_pair = sgm->w_offset_pair.value;
+    pair->index = index;
+    pair->data = position;
+}
 
-    // The data inserted into the segment
-    // has size: header size + buf size.
-    const size_t header_size = sizeof(struct header);
-    const size_t frame_size = header_size + size;
+static void clear_range(volatile unsigned char* addr, size_t from, size_t to) {
+    // Only pages holding data are written.
+    unsigned char* bytes = (unsigned char*)addr;
+    while (from < to) {
+        const size_t end = min(page_aligned_addr(from) + pagesize(), to);
+        for (size_t i = from; i < end; ++i) {
+            if (bytes[i] != 0) {
+                memset(bytes + from, 0, end - from);
+                break;
+            }
+        }
+        from = end;
+    }
+}
 
-    // w_offset marks the begging of the area in the log,
-    // where the frame can be written.
-    const size_t w_offset = curr_w_offset_pair.data;
+static size_t truncate_frames(segment_t* sgm, struct offset_pair at) {
+    // Frames claimed after the torn one may have been written: a
+    // later search of the write offset must not find them.
+    const size_t page_end = page_aligned_addr(at.data + pagesize() - 1);
+    size_t end = min(page_end, (size_t)sgm->size);
+    clear_range(sgm->buffer, at.data, end);
+    if (end < sgm->size) {
+        int rc = -1;
+        int fd = open(sgm->data_path, O_RDWR);
+        if (fd >= 0) {
+            rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                           end, sgm->size - end);
+            close(fd);
+        }
+        if (rc != 0) {
+            clear_range(sgm->buffer, end, sgm->size);
+            end = sgm->size;
+        }
+    }
+
+    const volatile unsigned char* entry = NULL;
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        entry = (const volatile unsigned char*)&sgm->index[at.index];
+    } else {
+        const uint32_t k = (at.index + sgm->interval - 1) / sgm->interval;
+        entry = (const volatile unsigned char*)&sgm->positions[k];
+    }
+    clear_range(sgm->index_map, entry - sgm->index_map, sgm->index_size);
+
+    // returns the end of the data cleared in the mapping
+    return end;
+}
 
-    // Make sure there's always available space to include
-    // and End Of Segment (EOS) frame.
-    // To enforce this, a payload can only be inserted if:
-    // sizeof(payload) + 2 * sizeof(header) <= space left in segment.
-    if (header_size + frame_size > sgm->size - w_offset) {
-        // No more entries in this segment: add EOS frame.
-        return mark_eos(sgm, curr_w_offset_pair);
+int segment_recover(segment_t* sgm, uint32_t index, uint32_t data) {
+    if (sgm->state & SGM_MAPPED) {
+        return 0;
     }
 
-    const struct offset_pair new_w_offset_pair = {
-        .index = curr_w_offset_pair.index + 1,
-        .data = curr_w_offset_pair.data + frame_size
+    int rc = map_files(sgm);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Frames before the sync point are on disk.
+    struct offset_pair w_offset_pair = {
+        .index = 0,
+        .data = 0
     };
+    if (data <= sgm->size && index <= sgm->capacity) {
+        w_offset_pair.index = index;
+        w_offset_pair.data = data;
+    }
 
-    int rc = claim(sgm, curr_w_offset_pair, new_w_offset_pair);
+    recover_frames(sgm, &w_offset_pair);
+    size_t cleared = w_offset_pair.data;
+    if (w_offset_pair.data < sgm->size) {
+        // First torn frame: its offset and the following ones
+        // are written again.
+        cleared = truncate_frames(sgm, w_offset_pair);
+    }
+
+    // The rebuilt index and the cleared frames are synced:
+    // recovering again finds the same write offset.
+    if (pwrite_engine(sgm)) {
+        rc = write_back(sgm, w_offset_pair.data, cleared);
+        if (rc == 0) {
+            rc = write_back_index(sgm, 0, sgm->index_size);
+        }
+    } else {
+        rc = msync((void*)sgm->buffer, sgm->size, MS_SYNC);
+        if (rc == 0) {
+            rc = msync((void*)sgm->index_map, sgm->index_size, MS_SYNC);
+        }
+    }
+    if (rc != 0) {
+        unmap_files(sgm);
+        return ELDTSYN;
+    }
+
+    union cas_offset_pair cas_w_offset_pair = {
+        .value = w_offset_pair
+    };
+
+    sgm->w_offset_pair = cas_w_offset_pair;
+    sgm->r_offset_pair = cas_w_offset_pair;
+    sgm->s_offset_pair = cas_w_offset_pair.value;
+    sgm->faulted = 0;
+
+    __sync_synchronize();
+    sgm->state = SGM_MAPPED;
+
+    return 0;
+}
+
+int segment_seal(segment_t* sgm) {
+    const size_t header_size = sizeof(struct header);
+
+    const struct offset_pair curr = load_w_offset_pair(sgm).value;
+    if (sealed(sgm, curr) || sgm->size - curr.data < header_size) {
+        return 0;
+    }
+
+    const int rc = mark_eos(sgm, curr);
+    return rc == ELEOS ? 0 : rc;
+}
+
+int segment_unmap(segment_t* sgm) {
+    // Fails if the segment is being read.
+    if (!__sync_bool_compare_and_swap(&sgm->state, SGM_MAPPED, 0)) {
+        return ELLOCK;
+    }
+
+    // Remapping the segment considers everything written as synced.
+    const ssize_t rc = sync_segment(sgm);
+    unmap_files(sgm);
+
+    return rc < 0 ? rc : 0;
+}
+
+int segment_detach(segment_t* sgm, int sync, struct segment_mapping* m) {
+    // Fails if the segment is being read.
+    if (!__sync_bool_compare_and_swap(&sgm->state, SGM_MAPPED, 0)) {
+        return ELLOCK;
+    }
+
+    const ssize_t rc = sync ? sync_segment(sgm) : 0;
+
+    // The segment can be mapped again right away, the files are
+    // unmapped by the caller.
+    m->data = (void*)sgm->buffer;
+    m->data_size = sgm->size;
+    m->index = (void*)sgm->index_map;
+    m->index_size = sgm->index_size;
+
+    return rc < 0 ? rc : 0;
+}
+
+void segment_release_mapping(const struct segment_mapping* m) {
+    munmap(m->data, m->data_size);
+    munmap(m->index, m->index_size);
+}
+
+int segment_open(segment_t** sgm_ptr,
+                 const char* dir,
+                 uint64_t base_offset,
+                 uint32_t size,  // segment max size: 4GB
+                 unsigned int flags,
+                 uint32_t interval) {
+    segment_t* sgm = NULL;
+    int rc = segment_register(&sgm, dir, base_offset, size, flags, interval);
     if (rc != 0) {
         return rc;
     }
 
-    MQLOG_PRINT("segment_write %p, "
-              "curr offset pair: (%"PRIu32", %"PRIu32"), "
-              "new offset pair (%"PRIu32", %"PRIu32")\n",
-              (void*)sgm,
-              curr_w_offset_pair.index,
-              curr_w_offset_pair.data,
-              new_w_offset_pair.index,
-              new_w_offset_pair.data);
+    rc = segment_map(sgm);
+    if (rc != 0) {
+        free(sgm);
+        return rc;
+    }
+
+    *sgm_ptr = sgm;
+
+    return 0;
+}
+
+int segment_prepare(segment_t** sgm_ptr,
+                    const char* dir,
+                    uint32_t size,
+                    unsigned int flags,
+                    uint32_t interval) {
+    // Size has to be a multiple of page size.
+    if (size % pagesize() != 0) {
+        return ELNOPGM;
+    }
+
+    struct segment* sgm = alloc_segment(size, flags, interval);
+    if (!sgm) {
+        return ELALLC;
+    }
+
+    const size_t len = 64;
+    char index_file[len];
+    char data_file[len];
+    if (spare_filename(index_file, len, INDEX_SUFFIX) == -1 ||
+        spare_filename(data_file, len, DATA_SUFFIX) == -1) {
+        free(sgm);
+        return ELSOFLW;
+    }
+
+    int rc = set_paths(sgm, dir, index_file, data_file);
+    if (rc != 0) {
+        free(sgm);
+        return rc;
+    }
+
+    // Spare files left behind by a previous run are never reused,
+    // they may have been created with a different size.
+    unlink(sgm->index_path);
+    unlink(sgm->data_path);
+
+    rc = map_files(sgm);
+    if (rc != 0) {
+        free(sgm);
+        return rc;
+    }
+
+    // Nothing is ever written to a spare segment before it is
+    // activated: there is no need to look for the write offset.
+    sgm->state = SGM_MAPPED;
+    *sgm_ptr = sgm;
+
+    return 0;
+}
+
+int segment_activate(segment_t* sgm, const char* dir, uint64_t base_offset) {
+    const size_t len = 64;
+    char index_file[len];
+    char data_file[len];
+    if (index_filename(index_file, len, base_offset) == -1 ||
+        data_filename(data_file, len, base_offset) == -1) {
+        return ELSOFLW;
+    }
+
+    char index_path[PATH_SIZE];
+    char data_path[PATH_SIZE];
+    if (append_file_to_dir(index_path, PATH_SIZE, dir, index_file) == -1 ||
+        append_file_to_dir(data_path, PATH_SIZE, dir, data_file) == -1) {
+        return ELSOFLW;
+    }
+
+    // The index goes first: a data file is what makes a segment part
+    // of the log, an orphan index file is simply reused.
+    if (rename(sgm->index_path, index_path) != 0) {
+        return ELFLEOP;
+    }
+    memcpy(sgm->index_path, index_path, PATH_SIZE);
+
+    if (rename(sgm->data_path, data_path) != 0) {
+        return ELFLEOP;
+    }
+    memcpy(sgm->data_path, data_path, PATH_SIZE);
+
+    sgm->base_offset = base_offset;
+
+    return 0;
+}
+
+int segment_recycle(segment_t** sgm_ptr,
+                    const segment_t* old,
+                    const char* dir,
+                    uint64_t id) {
+    struct segment* sgm = alloc_segment(old->size, old->flags, old->interval);
+    if (!sgm) {
+        return ELALLC;
+    }
+
+    const size_t len = 64;
+    char index_file[len];
+    char data_file[len];
+    if (pool_filename(index_file, len, id, INDEX_SUFFIX) == -1 ||
+        pool_filename(data_file, len, id, DATA_SUFFIX) == -1) {
+        free(sgm);
+        return ELSOFLW;
+    }
+
+    int rc = set_paths(sgm, dir, index_file, data_file);
+    if (rc != 0) {
+        free(sgm);
+        return rc;
+    }
+
+    // The data file goes first: the segment leaves the log. Mappings
+    // of the old segment stay valid.
+    if (rename(old->data_path, sgm->data_path) != 0) {
+        free(sgm);
+        return ELFLEOP;
+    }
+
+    if (rename(old->index_path, sgm->index_path) != 0) {
+        unlink(sgm->data_path);
+        unlink(old->index_path);
+        free(sgm);
+        return ELFLEOP;
+    }
+
+    *sgm_ptr = sgm;
+
+    return 0;
+}
+
+static int zero_file(const char* path, off_t from) {
+    const ssize_t size = file_size(path);
+    if (size < 0) {
+        return ELFLEOP;
+    }
+    if (size <= from) {
+        return 0;
+    }
+
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        return ELFLEOP;
+    }
+
+    // The blocks stay allocated, the extents read back as zeros.
+    const int mode = FALLOC_FL_KEEP_SIZE;
+    int rc = fallocate(fd, FALLOC_FL_ZERO_RANGE | mode, from, size - from);
+    if (rc != 0 && (errno == EOPNOTSUPP || errno == EINVAL)) {
+        // Not supported by every filesystem: the blocks are freed,
+        // then allocated again.
+        rc = fallocate(fd, FALLOC_FL_PUNCH_HOLE | mode, from, size - from);
+        if (rc == 0) {
+            fallocate(fd, 0, from, size - from);
+        }
+    }
+    close(fd);
+
+    return rc == 0 ? 0 : ELFLEOP;
+}
+
+int segment_reuse(segment_t* sgm) {
+    // The header of a sparse index is kept, it describes the entries.
+    off_t entries = 0;
+    int fd = open(sgm->index_path, O_RDONLY);
+    if (fd < 0) {
+        return ELFLEOP;
+    }
+
+    struct index_header hdr;
+    if (read_index_header(fd, &hdr) == 0 &&
+        hdr.magic == INDEX_MAGIC &&
+        hdr.version == SEGMENT_VERSION_SPARSE &&
+        hdr.interval != 0) {
+        entries = sizeof(struct index_header);
+    }
+    close(fd);
+
+    // Frames of the old segment can't be mistaken for new ones.
+    if (zero_file(sgm->index_path, entries) != 0 ||
+        zero_file(sgm->data_path, 0) != 0) {
+        return ELFLEOP;
+    }
+
+    int rc = map_files(sgm);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Like a spare segment, nothing is written yet.
+    sgm->state = SGM_MAPPED;
+
+    return 0;
+}
+
+int segment_close(segment_t* sgm) {
+    if (sgm->state & SGM_MAPPED) {
+        int rc = segment_sync(sgm);
+        if (rc < 0) {
+            return rc;
+        }
+
+        // Reclaim all resources.
+        unmap_files(sgm);
+    }
+    free(sgm);
+
+    // TODO: the directory may require fsyncing too.
+
+    return 0;
+}
+
+int segment_delete(segment_t* sgm) {
+    if (sgm->state & SGM_MAPPED) {
+        unmap_files(sgm);
+    }
+
+    const int rc = segment_unlink(sgm);
+    free(sgm);
+
+    return rc;
+}
+
+int segment_unlink(const segment_t* sgm) {
+    // Mappings stay valid: the space is freed once unmapped.
+    int errors = 0;
+    if (unlink(sgm->data_path) != 0) {
+        ++errors;
+    }
+    if (unlink(sgm->index_path) != 0) {
+        ++errors;
+    }
+
+    return errors == 0 ? 0 : ELFLEOP;
+}
+
+int segment_discard(segment_t* sgm) {
+    // Like `segment_unmap`, without syncing.
+    if (!(sgm->state & SGM_MAPPED)) {
+        return 0;
+    }
+
+    // Fails if the segment is being read.
+    if (!__sync_bool_compare_and_swap(&sgm->state, SGM_MAPPED, 0)) {
+        return ELLOCK;
+    }
+
+    unmap_files(sgm);
+
+    return 0;
+}
+
+static void populate(segment_t* sgm, uint32_t from, uint32_t to) {
+    volatile unsigned char* addr = sgm->buffer + from;
+    const size_t len = to - from;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise((void*)addr, len, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+#endif
+
+    // Older kernels: touch every page. Producers may already be
+    // writing to these pages, adding 0 atomically doesn't race with them.
+    for (size_t i = 0; i < len; i += pagesize()) {
+        __sync_fetch_and_add(addr + i, 0);
+    }
+}
+
+int segment_prefault(segment_t* sgm, uint32_t window) {
+    const uint32_t data = sgm->w_offset_pair.value.data;
+    const uint32_t from = max(sgm->faulted, page_aligned_addr(data));
+    const uint32_t to = (uint32_t)min((uint64_t)data + window,
+                                      (uint64_t)sgm->size);
+    if (from >= to) {
+        return 0;
+    }
+
+    // Allocate the blocks first, the files are sparse. Not every
+    // filesystem supports it: page faults allocate them otherwise.
+    int fd = open(sgm->data_path, O_RDWR);
+    if (fd >= 0) {
+        fallocate(fd, 0, from, to - from);
+        close(fd);
+    }
+
+    populate(sgm, from, to);
+    sgm->faulted = to;
+
+    return 0;
+}
+
+uint32_t segment_faulted(const segment_t* sgm) {
+    return sgm->faulted;
+}
+
+int segment_mapped(const segment_t* sgm) {
+    return (sgm->state & SGM_MAPPED) != 0;
+}
+
+int segment_acquire(segment_t* sgm) {
+    for (;;) {
+        const uint32_t state = sgm->state;
+        if (!(state & SGM_MAPPED)) {
+            return ELUNMAP;
+        }
+
+        if (__sync_bool_compare_and_swap(&sgm->state, state, state + 1)) {
+            break;
+        }
+    }
+
+    // Avoid writing to a shared cache line when not needed.
+    if (!sgm->referenced) {
+        sgm->referenced = 1;
+    }
+
+    return 0;
+}
+
+void segment_release(segment_t* sgm) {
+    __sync_sub_and_fetch(&sgm->state, 1);
+}
+
+int segment_referenced(segment_t* sgm) {
+    // Clears the flag, like the reference bit of the clock algorithm.
+    const int referenced = sgm->referenced;
+    if (referenced) {
+        sgm->referenced = 0;
+    }
+
+    return referenced;
+}
+
+int segment_quiescent(segment_t* sgm) {
+    // Producers may still be writing frames claimed before the
+    // segment was sealed: it has to be mapped until they are done.
+    // The EOS frame and every frame before it are ready.
+    const union cas_offset_pair curr = load_w_offset_pair(sgm);
+    const union cas_offset_pair ready = {
+        .value = load_r_offset_pair(sgm)
+    };
+
+    return sealed(sgm, curr.value) && ready.cas_helper == curr.cas_helper;
+}
+
+int segment_durable(const segment_t* sgm) {
+    // Sealed, every frame ready and synced.
+    const union cas_offset_pair curr = load_w_offset_pair(sgm);
+    return sealed(sgm, curr.value) &&
+           sgm->s_offset_pair.index == curr.value.index &&
+           sgm->s_offset_pair.data == curr.value.data;
+}
+
+int segment_sealed(const segment_t* sgm) {
+    return sealed(sgm, load_w_offset_pair(sgm).value);
+}
+
+void segment_synced(const segment_t* sgm, uint32_t* index, uint32_t* data) {
+    *index = sgm->s_offset_pair.index;
+    *data = sgm->s_offset_pair.data;
+}
+
+uint32_t segment_size(const segment_t* sgm) {
+    return sgm->size;
+}
+
+uint32_t segment_data_offset(const segment_t* sgm) {
+    return sgm->w_offset_pair.value.data;
+}
+
+// TODO: should be called `segment_base_offset`
+uint64_t segment_base_offset(const segment_t* sgm) {
+    return sgm->base_offset;
+}
+
+uint64_t segment_write_offset(const segment_t* sgm) {
+    return sgm->base_offset + sgm->w_offset_pair.value.index;
+}
+
+uint64_t segment_read_offset(const segment_t* sgm) {
+    // Only what has been written can be read.
+    return sgm->base_offset + sgm->w_offset_pair.value.index;
+}
+
+size_t segment_max_payload(uint32_t size) {
+    // A frame always leaves enough space for an EOS frame.
+    return size - 2 * sizeof(struct header);
+}
+
+static void fill_frame(segment_t* sgm,
+                       struct offset_pair at,
+                       const void* buf,
+                       size_t size) {
+    const size_t header_size = sizeof(struct header);
+    const size_t frame_size = header_size + size;
+
+    // w_offset marks the begging of the area in the log,
+    // where the frame can be written.
+    const size_t w_offset = at.data;
 
     // Calculate the offset where to insert the payload.
     const size_t payload_offset = w_offset + header_size;
@@ -511,32 +1513,134 @@ ssize_t segment_write(segment_t* sgm, const void* buf, size_t size) {
     //
     // TODO: Double check this, it may not be true.
     // See http://0b4af6cdc2f0c5998459-c0245c5c937c5dedcca3f1764ecc9b2f.r43.cf2.rackcdn.com/17780-osdi14-paper-pillai.pdf
-    memcpy((unsigned char*)sgm->buffer + payload_offset, buf, size);
+    //
+    // Useful to check a segment's file data integrity: the payload
+    // is copied and its checksum calculated in a single pass.
+    const uint32_t crc = crc32c_copy(CRC32_INIT,
+                                     (unsigned char*)sgm->buffer +
+                                         payload_offset,
+                                     buf,
+                                     size);
 
     struct header* hdr = (struct header*)(sgm->buffer + w_offset);
     header_init(hdr);
-
-    // Useful to check a segment's file data integrity.
-    // TODO: is this really needed? Does a filesystem do this?.
-    // TODO: should this be calculated before reserving an area in
-    // the segment?
-    hdr->crc32 = crc32(CRC32_INIT, buf, size);
+    hdr->crc32 = crc;
     hdr->size = frame_size;
+}
+
+static void publish_frame(segment_t* sgm, struct offset_pair at) {
+    // The caller makes sure payload and header are visible
+    // before the flag is.
+    const size_t w_offset = at.data;
+    struct header* hdr = (struct header*)(sgm->buffer + w_offset);
+
+    // Update the index, after inserting data.
+    // In case of a crash, the index is rebuilt by scanning
+    // the data: see `segment_recover`.
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        const size_t i_offset = at.index;
+        const struct index_entry entry = {
+            .physical_offset = w_offset,
+        };
+        sgm->index[i_offset] = entry;
+
+        // The flag is the last store of a producer to the segment.
+        __sync_synchronize();
+    }
 
     // Marks content as ready to be consumed.
     // This flag is needed because w_offset is incremented before
     // the new playload is inserted.
     hdr->flags = HEADER_FLAGS_READY;
+}
 
-    // Update the index, after inserting data.
-    // In case of a crash, the index can be rebuilt by scanning
-    // the data.
-    // TODO: add functionality to rebuild the index.
-    const size_t i_offset = curr_w_offset_pair.index;
-    const struct index_entry entry = {
-        .physical_offset = w_offset,
-    };
-    sgm->index[i_offset] = entry;
+static void index_frame(segment_t* sgm,
+                        struct offset_pair at,
+                        size_t frame_size) {
+    // Readers locate frames by walking headers from the closest
+    // indexed frame: the size of a claimed frame is known right away.
+    struct header* hdr = (struct header*)(sgm->buffer + at.data);
+    hdr->size = frame_size;
+
+    if (sgm->version != SEGMENT_VERSION_DENSE &&
+        at.index % sgm->interval == 0) {
+        sgm->positions[at.index / sgm->interval] = at.data;
+    }
+}
+
+static int claim_frame(segment_t* sgm,
+                       size_t size,
+                       struct offset_pair* at) {
+    // The data inserted into the segment
+    // has size: header size + buf size.
+    const size_t header_size = sizeof(struct header);
+    const size_t frame_size = header_size + size;
+
+    struct offset_pair curr_w_offset_pair;
+    struct offset_pair new_w_offset_pair;
+
+    // Lock free: a failed claim means another producer has
+    // inserted a frame in the meantime, try again after it.
+    do {
+        curr_w_offset_pair = load_w_offset_pair(sgm).value;
+
+        // First of all check if the segment is writable.
+        if (sealed(sgm, curr_w_offset_pair)) {
+            return ELEOS;
+        }
+
+        // Make sure there's always available space to include
+        // and End Of Segment (EOS) frame.
+        // To enforce this, a payload can only be inserted if:
+        // sizeof(payload) + 2 * sizeof(header) <= space left in segment.
+        if (header_size + frame_size >
+            sgm->size - curr_w_offset_pair.data ||
+            curr_w_offset_pair.index >= sgm->capacity) {
+            // No more entries in this segment: add EOS frame.
+            const int rc = mark_eos(sgm, curr_w_offset_pair);
+            if (rc == ELLOCK) {
+                continue;
+            }
+            return rc;
+        }
+
+        new_w_offset_pair.index = curr_w_offset_pair.index + 1;
+        new_w_offset_pair.data = curr_w_offset_pair.data + frame_size;
+    } while (claim(sgm, curr_w_offset_pair, new_w_offset_pair) != 0);
+
+    MQLOG_PRINT("segment_write %p, "
+              "curr offset pair: (%"PRIu32", %"PRIu32"), "
+              "new offset pair (%"PRIu32", %"PRIu32")\n",
+              (void*)sgm,
+              curr_w_offset_pair.index,
+              curr_w_offset_pair.data,
+              new_w_offset_pair.index,
+              new_w_offset_pair.data);
+
+    index_frame(sgm, curr_w_offset_pair, frame_size);
+
+    *at = curr_w_offset_pair;
+    return 0;
+}
+
+ssize_t segment_write(segment_t* sgm,
+                      const void* buf,
+                      size_t size,
+                      uint64_t* relative_offset) {
+    struct offset_pair at;
+    const int rc = claim_frame(sgm, size, &at);
+    if (rc != 0) {
+        return rc;
+    }
+
+    fill_frame(sgm, at, buf, size);
+    __sync_synchronize();
+    publish_frame(sgm, at);
+    advance_ready(sgm);
+
+    if (relative_offset) {
+        *relative_offset = at.index;
+    }
 
     // Returns the number of bytes of the initial buffer that
     // have been inserted into the segment.
@@ -544,30 +1648,179 @@ ssize_t segment_write(segment_t* sgm, const void* buf, size_t size) {
     return size;
 }
 
-ssize_t segment_read(const segment_t* sgm,
-                     uint64_t relative_offset,
-                     struct frame* fr) {
-    size_t boundary = sgm->w_offset_pair.value.data;
-    if ((sgm->flags & SGM_RDCMT) == SGM_RDCMT) {
-        boundary = sgm->s_offset_pair.data;
+ssize_t segment_writev(segment_t* sgm,
+                       const struct iovec* iov,
+                       int iovcnt,
+                       uint64_t* relative_offset,
+                       uint32_t* written) {
+    const size_t header_size = sizeof(struct header);
+
+    struct offset_pair curr_w_offset_pair;
+    struct offset_pair new_w_offset_pair;
+    uint32_t frames = 0;
+    int n = 0;
+
+    // Same as `segment_write`, but the index slots and the data area
+    // of all the frames that fit are claimed at once.
+    do {
+        curr_w_offset_pair = load_w_offset_pair(sgm).value;
+
+        if (sealed(sgm, curr_w_offset_pair)) {
+            return ELEOS;
+        }
+
+        const size_t available = sgm->size - curr_w_offset_pair.data;
+        size_t frames_size = 0;
+        frames = 0;
+        for (n = 0; n < iovcnt; ++n) {
+            if (iov[n].iov_len == 0) {
+                // empty payloads are not inserted
+                continue;
+            }
+
+            const size_t frame_size = header_size + iov[n].iov_len;
+            if (header_size + frames_size + frame_size > available ||
+                curr_w_offset_pair.index + frames >= sgm->capacity) {
+                break;
+            }
+
+            frames_size += frame_size;
+            ++frames;
+        }
+
+        if (frames == 0 && n == iovcnt) {
+            // Only empty payloads: nothing is claimed.
+            *written = 0;
+            return n;
+        }
+
+        if (frames == 0) {
+            // Not even the first frame fits: add EOS frame.
+            const int rc = mark_eos(sgm, curr_w_offset_pair);
+            if (rc == ELLOCK) {
+                continue;
+            }
+            return rc;
+        }
+
+        new_w_offset_pair.index = curr_w_offset_pair.index + frames;
+        new_w_offset_pair.data = curr_w_offset_pair.data + frames_size;
+    } while (claim(sgm, curr_w_offset_pair, new_w_offset_pair) != 0);
+
+    *relative_offset = curr_w_offset_pair.index;
+    *written = frames;
+
+    struct offset_pair at = curr_w_offset_pair;
+    for (int i = 0; i < n; ++i) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+
+        index_frame(sgm, at, header_size + iov[i].iov_len);
+        fill_frame(sgm, at, iov[i].iov_base, iov[i].iov_len);
+
+        ++at.index;
+        at.data += header_size + iov[i].iov_len;
     }
 
-    const size_t i_offset = sgm->w_offset_pair.value.index;
+    // One barrier for the whole batch.
+    __sync_synchronize();
 
-    // Check that the physical offset is within the right boundary.
-    if (relative_offset >= i_offset) {
-        return ELNORD;
+    at = curr_w_offset_pair;
+    for (int i = 0; i < n; ++i) {
+        if (iov[i].iov_len == 0) {
+            continue;
+        }
+
+        publish_frame(sgm, at);
+
+        ++at.index;
+        at.data += header_size + iov[i].iov_len;
     }
+    advance_ready(sgm);
 
-    // Index lookup O(1)
-    volatile const struct index_entry* entry = &sgm->index[relative_offset];
-    const size_t physical_offset = entry->physical_offset;
+    // Returns the number of payloads consumed, empty ones included.
+    // The `written` frames are stored at consecutive offsets.
+    return n;
+}
 
-    if (relative_offset != 0 && physical_offset == 0) {
-        // physical_offset can be zero only if relative_offset is zero
+int segment_reserve(segment_t* sgm,
+                    size_t size,
+                    struct segment_ticket* ticket,
+                    void** ptr) {
+    struct offset_pair at;
+    const int rc = claim_frame(sgm, size, &at);
+    if (rc != 0) {
+        return rc;
+    }
+
+    // Readers skip the frame until it gets committed.
+    struct header* hdr = (struct header*)(sgm->buffer + at.data);
+    header_init(hdr);
+
+    ticket->index = at.index;
+    ticket->position = at.data;
+    ticket->size = size;
+
+    // The caller writes the payload in place.
+    *ptr = (void*)(sgm->buffer + at.data + sizeof(struct header));
+
+    return 0;
+}
+
+ssize_t segment_commit(segment_t* sgm, const struct segment_ticket* ticket) {
+    const size_t header_size = sizeof(struct header);
+    const struct offset_pair at = {
+        .index = ticket->index,
+        .data = ticket->position
+    };
+
+    struct header* hdr = (struct header*)(sgm->buffer + at.data);
+    const void* payload = (const void*)(sgm->buffer + at.data + header_size);
+
+    hdr->crc32 = crc32c(CRC32_INIT, payload, ticket->size);
+    hdr->size = header_size + ticket->size;
+
+    __sync_synchronize();
+    publish_frame(sgm, at);
+    advance_ready(sgm);
+
+    return ticket->size;
+}
+
+static int locate_frame(const segment_t* sgm,
+                        uint64_t relative_offset,
+                        size_t boundary,
+                        size_t* physical_offset) {
+    const size_t header_size = sizeof(struct header);
+    const uint32_t k = relative_offset / sgm->interval;
+
+    size_t position = sgm->positions[k];
+    if (k != 0 && position == 0) {
+        // The indexed frame has been claimed, not indexed yet.
         return ELNORD;
     }
 
+    // Forward scan from the indexed frame, at most `interval - 1`
+    // headers. Frames skipped don't have to be ready.
+    for (uint32_t i = k * sgm->interval; i < relative_offset; ++i) {
+        const volatile struct header* hdr =
+            (const volatile struct header*)(sgm->buffer + position);
+        const uint32_t size = hdr->size;
+        if (size < header_size || position + size >= boundary) {
+            return ELNORD;
+        }
+        position += size;
+    }
+
+    *physical_offset = position;
+    return 0;
+}
+
+static ssize_t read_frame(const segment_t* sgm,
+                          size_t physical_offset,
+                          size_t boundary,
+                          struct frame* fr) {
     // Check that the physical offset is within the right boundary.
     if (physical_offset >= boundary) {
         return ELNORD;
@@ -605,11 +1858,141 @@ ssize_t segment_read(const segment_t* sgm,
     return fr->hdr->size - header_size;
 }
 
+static struct offset_pair read_watermark(const segment_t* sgm) {
+    // Frames below the watermark can be read: they are all ready,
+    // and synced as well when reading committed frames.
+    if ((sgm->flags & SGM_RDCMT) == SGM_RDCMT) {
+        const struct offset_pair synced = {
+            .index = sgm->s_offset_pair.index,
+            .data = sgm->s_offset_pair.data
+        };
+        return synced;
+    }
+
+    return load_r_offset_pair(sgm);
+}
+
+ssize_t segment_read(const segment_t* sgm,
+                     uint64_t relative_offset,
+                     struct frame* fr) {
+    const struct offset_pair watermark = read_watermark(sgm);
+    const size_t boundary = watermark.data;
+
+    // Check that the frame is below the watermark.
+    if (relative_offset >= watermark.index) {
+        return ELNORD;
+    }
+
+    size_t physical_offset = 0;
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        // Index lookup O(1)
+        volatile const struct index_entry* entry =
+            &sgm->index[relative_offset];
+        physical_offset = entry->physical_offset;
+    } else {
+        const int rc = locate_frame(sgm,
+                                    relative_offset,
+                                    boundary,
+                                    &physical_offset);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    if (relative_offset != 0 && physical_offset == 0) {
+        // physical_offset can be zero only if relative_offset is zero
+        return ELNORD;
+    }
+
+    return read_frame(sgm, physical_offset, boundary, fr);
+}
+
+ssize_t segment_read_next(const segment_t* sgm,
+                          struct segment_cursor* cursor,
+                          struct frame* fr) {
+    ssize_t rc = 0;
+    if (cursor->index != 0 && cursor->position == 0) {
+        // The position of the first frame read is looked up.
+        rc = segment_read(sgm, cursor->index, fr);
+    } else {
+        const struct offset_pair watermark = read_watermark(sgm);
+        if (cursor->index >= watermark.index) {
+            // No frame can follow the last one of a sealed segment.
+            const struct offset_pair w_offset_pair =
+                load_w_offset_pair(sgm).value;
+            return sealed(sgm, w_offset_pair) &&
+                   cursor->index >= w_offset_pair.index ? ELEOS : ELNORD;
+        }
+
+        // The frame follows the previous one.
+        rc = read_frame(sgm, cursor->position, watermark.data, fr);
+    }
+
+    if (rc >= 0) {
+        const size_t position =
+            (const unsigned char*)fr->hdr - (const unsigned char*)sgm->buffer;
+        cursor->position = position + fr->hdr->size;
+        ++cursor->index;
+    }
+
+    return rc;
+}
+
+static void prefetch_frame(const segment_t* sgm, uint32_t index) {
+    // Only the indexed frames can be located ahead of the walk.
+    size_t position = 0;
+    if (sgm->version == SEGMENT_VERSION_DENSE) {
+        position = sgm->index[index].physical_offset;
+    } else {
+        position = sgm->positions[index / sgm->interval];
+    }
+
+    if (position < sgm->size) {
+        __builtin_prefetch((const void*)(sgm->buffer + position));
+    }
+}
+
+ssize_t segment_readv(const segment_t* sgm,
+                      uint64_t relative_offset,
+                      struct frame* frames,
+                      size_t max,
+                      size_t max_bytes) {
+    struct segment_cursor cursor = {
+        .index = relative_offset,
+        .position = 0
+    };
+
+    size_t count = 0;
+    size_t bytes = 0;
+    while (count < max) {
+        const uint64_t ahead = (uint64_t)cursor.index + PREFETCH_DISTANCE;
+        if (ahead < load_r_offset_pair(sgm).index) {
+            prefetch_frame(sgm, ahead);
+        }
+
+        struct frame fr;
+        const ssize_t rc = segment_read_next(sgm, &cursor, &fr);
+        if (rc < 0) {
+            return count > 0 ? (ssize_t)count : rc;
+        }
+
+        // The first frame is returned whatever its size.
+        if (count > 0 && bytes + rc > max_bytes) {
+            break;
+        }
+
+        frames[count++] = fr;
+        bytes += rc;
+    }
+
+    return count;
+}
+
 ssize_t segment_sync(segment_t* sgm) {
-    ssize_t size = sync_data(sgm);
-    if (size <= 0) {
-        return size;
+    if (!(sgm->state & SGM_MAPPED)) {
+        // Unmapped segments have been synced.
+        return 0;
     }
 
-    return sync_index(sgm);
+    return sync_segment(sgm);
 }
@@ -5,28 +5,144 @@
 #include <sys/types.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 typedef struct segment segment_t;
 
 
+// A frame claimed by `segment_reserve`, waiting to be committed.
+struct segment_ticket {
+    uint32_t index;     // relative offset
+    uint32_t position;  // physical offset
+    uint32_t size;      // payload size
+};
+
+// Next frame of a sequential reader.
+struct segment_cursor {
+    uint32_t index;     // relative offset
+    uint32_t position;  // physical offset, 0 until known
+};
+
+// Files of a segment as mapped, see `segment_detach`.
+struct segment_mapping {
+    void*  data;
+    size_t data_size;
+    void*  index;
+    size_t index_size;
+};
+
 #define SGM_RDDRT 0x0
 #define SGM_RDCMT 0x1
+#define SGM_PWRITE 0x2  // frames staged in memory, written with pwrite
+#define SGM_DIRECT 0x4  // SGM_PWRITE with O_DIRECT, where supported
 
 /* non thread safe functions */
+/* the last argument is the number of frames per index entry */
 int         segment_open(segment_t**,
                          const char*,
                          uint64_t,
                          uint32_t,
-                         unsigned int);
+                         unsigned int,
+                         uint32_t);
 int         segment_close(segment_t*);
 
+/* segments can be registered without being mapped, and unmapped
+ * when not read */
+int         segment_register(segment_t**,
+                             const char*,
+                             uint64_t,
+                             uint32_t,
+                             unsigned int,
+                             uint32_t);
+int         segment_map(segment_t*);
+/* the write offset is searched from a synced relative and
+ * physical offset */
+int         segment_map_from(segment_t*, uint32_t, uint32_t);
+/* the registered segment is sealed and synced at a relative and
+ * physical offset: it is mapped without searching its write offset */
+void        segment_set_final(segment_t*, uint32_t, uint32_t);
+int         segment_unmap(segment_t*);
+/* unmaps without syncing, fails with ELLOCK while being read */
+int         segment_discard(segment_t*);
+/* like `segment_unmap`, syncing if asked, the mapping is handed over
+ * instead: frames read from it stay valid until it's released */
+int         segment_detach(segment_t*, int, struct segment_mapping*);
+void        segment_release_mapping(const struct segment_mapping*);
+/* maps the segment after a crash: frames following the sync point
+ * are checked, their index entries rebuilt, the first torn frame and
+ * the ones after it are cleared */
+int         segment_recover(segment_t*, uint32_t, uint32_t);
+/* marks the end of the segment, no frame can be written after it */
+int         segment_seal(segment_t*);
+int         segment_quiescent(segment_t*);
+int         segment_referenced(segment_t*);
+
+/* spare segments, prepared ahead of time and activated on roll */
+int         segment_prepare(segment_t**,
+                            const char*,
+                            uint32_t,
+                            unsigned int,
+                            uint32_t);
+int         segment_activate(segment_t*, const char*, uint64_t);
+/* moves the files of an unused segment to a pooled segment, which is
+ * neither mapped nor activated */
+int         segment_recycle(segment_t**,
+                            const segment_t*,
+                            const char*,
+                            uint64_t);
+/* clears and maps a pooled segment, which can then be activated */
+int         segment_reuse(segment_t*);
+int         segment_delete(segment_t*);
+/* removes the files, the segment can still be unmapped or closed */
+int         segment_unlink(const segment_t*);
+
 uint64_t    segment_base_offset(const segment_t*);
 uint64_t    segment_write_offset(const segment_t*);
 uint64_t    segment_read_offset(const segment_t*);
+uint32_t    segment_data_offset(const segment_t*);
+uint32_t    segment_size(const segment_t*);
+int         segment_sealed(const segment_t*);
+/* sealed and synced up to its end */
+int         segment_durable(const segment_t*);
+void        segment_synced(const segment_t*, uint32_t*, uint32_t*);
+size_t      segment_max_payload(uint32_t);
+
+/* populates the pages ahead of the write offset */
+int         segment_prefault(segment_t*, uint32_t);
+uint32_t    segment_faulted(const segment_t*);
 
 /* thread safe functions */
-ssize_t     segment_write(segment_t*, const void*, size_t);
+int         segment_mapped(const segment_t*);
+/* pins a mapped segment, ELUNMAP if it's not mapped */
+int         segment_acquire(segment_t*);
+void        segment_release(segment_t*);
+/* the relative offset of the frame written is optional */
+ssize_t     segment_write(segment_t*, const void*, size_t, uint64_t*);
+/* returns the number of payloads consumed, empty ones are skipped:
+ * the relative offset is the one of the first of the frames written */
+ssize_t     segment_writev(segment_t*,
+                           const struct iovec*,
+                           int,
+                           uint64_t*,
+                           uint32_t*);
+int         segment_reserve(segment_t*,
+                            size_t,
+                            struct segment_ticket*,
+                            void**);
+ssize_t     segment_commit(segment_t*, const struct segment_ticket*);
 ssize_t     segment_read(const segment_t*, uint64_t, struct frame*);
+/* reads the frame of the cursor and moves it to the next one,
+ * ELEOS after the last frame of a sealed segment */
+ssize_t     segment_read_next(const segment_t*,
+                              struct segment_cursor*,
+                              struct frame*);
+/* reads the frames following a relative offset, up to a number of
+ * frames and of payload bytes: returns the number of frames read */
+ssize_t     segment_readv(const segment_t*,
+                          uint64_t,
+                          struct frame*,
+                          size_t,
+                          size_t);
 ssize_t     segment_sync(segment_t*);
 
 #endif
@@ -0,0 +1,143 @@
+#include "worker.h"
+#include "mqlogerrno.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+
+struct worker {
+    pthread_t       thread;
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    worker_task_t   task;
+    void*           arg;
+    unsigned int    interval_ms;
+    struct timespec due;        // next run scheduled by the task
+    int             scheduled;  // protected by `lock`
+    int             pending;    // protected by `lock`
+    int             stopped;    // protected by `lock`
+};
+
+static void deadline(struct timespec* ts, unsigned int interval_ms) {
+    clock_gettime(CLOCK_REALTIME, ts);
+    ts->tv_sec += interval_ms / 1000;
+    ts->tv_nsec += (long)(interval_ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static int earlier(const struct timespec* a, const struct timespec* b) {
+    return a->tv_sec < b->tv_sec ||
+           (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void* run(void* arg) {
+    struct worker* w = (struct worker*)arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stopped) {
+        if (!w->pending) {
+            // Whichever comes first: the interval or the scheduled run.
+            struct timespec ts;
+            int timed = w->interval_ms > 0;
+            if (timed) {
+                deadline(&ts, w->interval_ms);
+            }
+            if (w->scheduled && (!timed || earlier(&w->due, &ts))) {
+                ts = w->due;
+                timed = 1;
+            }
+
+            if (timed) {
+                pthread_cond_timedwait(&w->cond, &w->lock, &ts);
+            } else {
+                pthread_cond_wait(&w->cond, &w->lock);
+            }
+
+            if (w->stopped) {
+                break;
+            }
+        }
+
+        w->pending = 0;
+        w->scheduled = 0;
+
+        // The task runs unlocked: producers notifying the worker
+        // never wait for it.
+        pthread_mutex_unlock(&w->lock);
+        w->task(w->arg);
+        pthread_mutex_lock(&w->lock);
+    }
+    pthread_mutex_unlock(&w->lock);
+
+    return NULL;
+}
+
+int worker_start(worker_t** w_ptr,
+                 worker_task_t task,
+                 void* arg,
+                 unsigned int interval_ms) {
+    struct worker* w = (struct worker*)malloc(sizeof(struct worker));
+    if (!w) {
+        return ELALLC;
+    }
+
+    memset(w, 0, sizeof(struct worker));
+    w->task = task;
+    w->arg = arg;
+    w->interval_ms = interval_ms;
+
+    if (pthread_mutex_init(&w->lock, NULL) != 0) {
+        free(w);
+        return ELLCKOP;
+    }
+
+    if (pthread_cond_init(&w->cond, NULL) != 0) {
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+        return ELLCKOP;
+    }
+
+    if (pthread_create(&w->thread, NULL, run, w) != 0) {
+        pthread_cond_destroy(&w->cond);
+        pthread_mutex_destroy(&w->lock);
+        free(w);
+        return ELWRKCR;
+    }
+
+    *w_ptr = w;
+
+    return 0;
+}
+
+void worker_notify(worker_t* w) {
+    pthread_mutex_lock(&w->lock);
+    w->pending = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+}
+
+void worker_schedule(worker_t* w, unsigned int delay_ms) {
+    pthread_mutex_lock(&w->lock);
+    deadline(&w->due, delay_ms);
+    w->scheduled = 1;
+    pthread_mutex_unlock(&w->lock);
+}
+
+int worker_stop(worker_t* w) {
+    pthread_mutex_lock(&w->lock);
+    w->stopped = 1;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+
+    int rc = pthread_join(w->thread, NULL);
+
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+
+    return rc == 0 ? 0 : ELWRKCR;
+}
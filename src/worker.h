@@ -0,0 +1,20 @@
+#ifndef MQLOG_WORKER_H_
+#define MQLOG_WORKER_H_
+
+/*
+ * A background thread running a task when notified, or at least
+ * every `interval_ms` milliseconds if the interval is not zero.
+ */
+
+typedef struct worker worker_t;
+
+typedef void (*worker_task_t)(void*);
+
+int  worker_start(worker_t**, worker_task_t, void*, unsigned int);
+void worker_notify(worker_t*);
+/* the task runs again within `delay_ms` milliseconds unless notified
+ * before, every run clears it: called by the task to be woken up */
+void worker_schedule(worker_t*, unsigned int);
+int  worker_stop(worker_t*);
+
+#endif
@@ -74,6 +74,28 @@ static void* consumer(void* arg) {
     return NULL;
 }
 
+static void* waiting_consumer(void* arg) {
+    struct thread_args* args = (struct thread_args*)arg;
+    mqlog_t* lg = (mqlog_t*)args->lg;
+
+    uint64_t offset = 0;
+    struct frame fr;
+
+    for (size_t i = 0; i < 128; ++i) {
+        // parks until the producer writes the frame
+        ssize_t read = mqlog_read_wait(lg, offset, &fr, NULL);
+
+        assert(read > 0);
+
+        struct string* sstr = &args->data[i];
+        sstr->len = frame_payload_size(&fr);
+        memcpy(sstr->str, fr.buffer, sstr->len);
+        ++offset;
+    }
+
+    return NULL;
+}
+
 TEST(simple_concurrency_test) {
     const size_t size = 4096;
     const char* dir = "/tmp/simple_concurrency_test";
@@ -116,3 +138,248 @@ TEST(simple_concurrency_test) {
 
     ASSERT(mqlog_close(lg) == 0);
 }
+
+TEST(waiting_concurrency_test) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/waiting_concurrency_test";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+
+    struct thread_args prod_args = {
+        .lg = lg
+    };
+
+    struct thread_args cons_args = {
+        .lg = lg
+    };
+
+    // the consumer starts first: it parks on frames not written yet
+    pthread_t prod0, cons0;
+    ASSERT(pthread_create(&cons0, NULL, waiting_consumer, &cons_args) == 0);
+    ASSERT(pthread_create(&prod0, NULL, producer, &prod_args) == 0);
+    ASSERT(pthread_join(prod0, NULL) == 0);
+    ASSERT(pthread_join(cons0, NULL) == 0);
+
+    for (int i = 0; i < 128; ++i) {
+        ASSERT(prod_args.data[i].len == cons_args.data[i].len);
+        ASSERT(strncmp(prod_args.data[i].str,
+               cons_args.data[i].str,
+               prod_args.data[i].len) == 0);
+    }
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+enum { PRODUCERS = 8 };
+enum { MESSAGES = 2048 };
+
+struct message {
+    int producer;
+    int seq;
+};
+
+struct producer_args {
+    mqlog_t* lg;
+    int      producer;
+    int      blocking;
+};
+
+static void* sequence_producer(void* arg) {
+    struct producer_args* args = (struct producer_args*)arg;
+
+    for (int i = 0; i < MESSAGES; ++i) {
+        const struct message msg = {
+            .producer = args->producer,
+            .seq = i
+        };
+
+        ssize_t written = mqlog_write(args->lg, &msg, sizeof(msg));
+        if (written == ELLOCK && !args->blocking) {
+            --i;
+            continue;
+        }
+        assert(written == sizeof(msg));
+    }
+
+    return NULL;
+}
+
+static void multi_producer(int* __errors,
+                           const char* dir,
+                           unsigned int flags) {
+    const size_t size = 4096;
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, size, flags);
+    ASSERT(rc == 0);
+    ASSERT(lg);
+
+    pthread_t prod[PRODUCERS];
+    struct producer_args args[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; ++i) {
+        args[i].lg = lg;
+        args[i].producer = i;
+        args[i].blocking = (flags & MQLOG_WRBLK) == MQLOG_WRBLK;
+        rc = pthread_create(&prod[i], NULL, sequence_producer, &args[i]);
+        ASSERT(rc == 0);
+    }
+
+    for (int i = 0; i < PRODUCERS; ++i) {
+        rc = pthread_join(prod[i], NULL);
+        ASSERT(rc == 0);
+    }
+
+    // every message is read exactly once, in order per producer
+    int next[PRODUCERS];
+    memset(next, 0, sizeof(next));
+
+    struct frame fr;
+    for (uint64_t offset = 0; offset < PRODUCERS * MESSAGES; ++offset) {
+        ssize_t read = mqlog_read(lg, offset, &fr);
+        ASSERT(read == sizeof(struct message));
+        if (read != sizeof(struct message)) {
+            break;
+        }
+
+        const struct message* msg = (const struct message*)fr.buffer;
+        ASSERT(msg->producer >= 0 && msg->producer < PRODUCERS);
+        ASSERT(msg->seq == next[msg->producer]);
+        ++next[msg->producer];
+    }
+
+    ASSERT(mqlog_read(lg, PRODUCERS * MESSAGES, &fr) == ELNORD);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(multi_producer_concurrency_test) {
+    multi_producer(__errors, "/tmp/multi_producer_concurrency_test", 0);
+}
+
+TEST(blocking_producer_concurrency_test) {
+    // producers never see `ELLOCK`
+    multi_producer(__errors,
+                   "/tmp/blocking_producer_concurrency_test",
+                   MQLOG_WRBLK);
+}
+
+enum { CONSUMERS = 4 };
+
+struct reader_args {
+    mqlog_t* lg;
+    int      errors;
+};
+
+static void* sequence_reader(void* arg) {
+    struct reader_args* args = (struct reader_args*)arg;
+
+    int next[PRODUCERS];
+    memset(next, 0, sizeof(next));
+
+    struct frame fr;
+    uint64_t offset = 0;
+    while (offset < PRODUCERS * MESSAGES) {
+        ssize_t read = mqlog_read(args->lg, offset, &fr);
+        if (read == ELNORD || read == ELINVHD) {
+            sched_yield();
+            continue;
+        }
+
+        // reads never wait for producers rolling segments
+        const struct message* msg = (const struct message*)fr.buffer;
+        if (read != sizeof(struct message) ||
+            msg->producer < 0 || msg->producer >= PRODUCERS ||
+            msg->seq != next[msg->producer]) {
+            ++args->errors;
+            break;
+        }
+
+        ++next[msg->producer];
+        ++offset;
+    }
+
+    return NULL;
+}
+
+TEST(concurrent_readers_test) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/concurrent_readers_test";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, size, MQLOG_WRBLK);
+    ASSERT(rc == 0);
+
+    pthread_t cons[CONSUMERS];
+    struct reader_args reader_args[CONSUMERS];
+    for (int i = 0; i < CONSUMERS; ++i) {
+        reader_args[i].lg = lg;
+        reader_args[i].errors = 0;
+        rc = pthread_create(&cons[i], NULL, sequence_reader, &reader_args[i]);
+        ASSERT(rc == 0);
+    }
+
+    pthread_t prod[PRODUCERS];
+    struct producer_args args[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; ++i) {
+        args[i].lg = lg;
+        args[i].producer = i;
+        args[i].blocking = 1;
+        rc = pthread_create(&prod[i], NULL, sequence_producer, &args[i]);
+        ASSERT(rc == 0);
+    }
+
+    for (int i = 0; i < PRODUCERS; ++i) {
+        ASSERT(pthread_join(prod[i], NULL) == 0);
+    }
+
+    for (int i = 0; i < CONSUMERS; ++i) {
+        ASSERT(pthread_join(cons[i], NULL) == 0);
+        ASSERT(reader_args[i].errors == 0);
+    }
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(retaining_producer_concurrency_test) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/retaining_producer_concurrency_test";
+
+    delete_directory(dir);
+
+    // segments expire while producers still write to them
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = MQLOG_WRBLK;
+    options.max_retained_segments = 1;
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    pthread_t prod[PRODUCERS];
+    struct producer_args args[PRODUCERS];
+    for (int i = 0; i < PRODUCERS; ++i) {
+        args[i].lg = lg;
+        args[i].producer = i;
+        args[i].blocking = 1;
+        ASSERT(pthread_create(&prod[i], NULL,
+                              sequence_producer, &args[i]) == 0);
+    }
+
+    for (int i = 0; i < PRODUCERS; ++i) {
+        ASSERT(pthread_join(prod[i], NULL) == 0);
+    }
+
+    struct frame fr;
+    ASSERT(mqlog_read(lg, PRODUCERS * MESSAGES - 1, &fr) ==
+           sizeof(struct message));
+    ASSERT(mqlog_read(lg, PRODUCERS * MESSAGES, &fr) == ELNORD);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
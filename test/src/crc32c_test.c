@@ -0,0 +1,78 @@
+#include "testfw.h"
+#include "test_util.h"
+#include <crc32c.h>
+#include <prot.h>
+#include <stdlib.h>
+#include <string.h>
+
+TEST(crc32c_check_value) {
+    const char* str = "123456789";
+    ASSERT(crc32c(0, str, strlen(str)) == 0xe3069283);
+    ASSERT(crc32c_sw(0, str, strlen(str)) == 0xe3069283);
+
+    // checksums can be chained
+    const uint32_t crc = crc32c(0, str, 4);
+    ASSERT(crc32c(crc, str + 4, strlen(str) - 4) == 0xe3069283);
+}
+
+TEST(crc32c_dispatch) {
+    // long enough for every lane size of the hardware implementation
+    const size_t size = 3 * 8192 * 2 + 3 * 256 + 13;
+    unsigned char* buf = (unsigned char*)malloc(size);
+    unsigned char* copy = (unsigned char*)malloc(size);
+    ASSERT(buf && copy);
+
+    srand(42);
+    for (size_t i = 0; i < size; ++i) {
+        buf[i] = rand() % 256;
+    }
+
+    const size_t lengths[] = {
+        0, 1, 7, 8, 9, 255, 768, 769, 3 * 8192, 3 * 8192 + 5, size
+    };
+
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); ++i) {
+        // unaligned buffers too
+        for (size_t shift = 0; shift < 3 && shift <= lengths[i]; ++shift) {
+            const size_t len = lengths[i] - shift;
+            const uint32_t expected = crc32c_sw(0, buf + shift, len);
+            ASSERT(crc32c(0, buf + shift, len) == expected);
+
+            memset(copy, 0, size);
+            ASSERT(crc32c_copy(0, copy, buf + shift, len) == expected);
+            ASSERT(memcmp(copy, buf + shift, len) == 0);
+        }
+    }
+
+    free(copy);
+    free(buf);
+}
+
+TEST(frame_verify_checksums) {
+    struct {
+        struct header hdr;
+        unsigned char payload[16];
+    } fr_buf;
+
+    memcpy(fr_buf.payload, "0123456789abcdef", 16);
+    header_init(&fr_buf.hdr);
+    fr_buf.hdr.size = sizeof(struct header) + 16;
+    fr_buf.hdr.crc32 = crc32c(0, fr_buf.payload, 16);
+
+    struct frame fr = {
+        .hdr = &fr_buf.hdr,
+        .buffer = fr_buf.payload
+    };
+    ASSERT(fr_buf.hdr.checksum == HEADER_CHECKSUM_CRC32C);
+    ASSERT(frame_verify(&fr));
+
+    fr_buf.payload[3] ^= 1;
+    ASSERT(!frame_verify(&fr));
+    fr_buf.payload[3] ^= 1;
+
+    // frames written before checksums were recorded use CRC32
+    fr_buf.hdr.checksum = HEADER_CHECKSUM_CRC32;
+    ASSERT(!frame_verify(&fr));
+    fr_buf.hdr.crc32 = 0x68c4f033;  // CRC32 of the payload
+    ASSERT(frame_verify(&fr));
+}
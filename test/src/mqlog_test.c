@@ -5,6 +5,11 @@
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
 #include <assert.h>
 
 TEST(mqlog_write_read) {
@@ -1566,3 +1571,1154 @@ TEST(mqlog_gating) {
 
     ASSERT(mqlog_close(lg) == 0);
 }
+
+TEST(mqlog_writev_read) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_writev_read";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, size, 0);
+    ASSERT(rc == 0);
+    ASSERT(lg);
+
+    ssize_t written = mqlog_write(lg, "first", 5);
+    ASSERT(written == 5);
+
+    // 100 frames of 100 bytes don't fit in a single segment
+    enum { FRAMES = 100 };
+    unsigned char payloads[FRAMES][100];
+    struct iovec iov[FRAMES];
+    size_t total = 0;
+    for (int i = 0; i < FRAMES; ++i) {
+        memset(payloads[i], i, sizeof(payloads[i]));
+        iov[i].iov_base = payloads[i];
+        iov[i].iov_len = sizeof(payloads[i]) - i % 7;
+        total += iov[i].iov_len;
+    }
+
+    uint64_t offset = 0;
+    written = mqlog_writev(lg, iov, FRAMES, &offset);
+    ASSERT((size_t)written == total);
+    ASSERT(offset == 1);
+
+    struct frame fr;
+    for (int i = 0; i < FRAMES; ++i) {
+        ssize_t read = mqlog_read(lg, offset + i, &fr);
+        ASSERT((size_t)read == iov[i].iov_len);
+        ASSERT(memcmp(fr.buffer, payloads[i], iov[i].iov_len) == 0);
+    }
+
+    ASSERT(mqlog_read(lg, offset + FRAMES, &fr) == ELNORD);
+
+    // a payload greater than the segment size fails the whole batch
+    unsigned char big[4096];
+    struct iovec big_iov[2] = {
+        { .iov_base = payloads[0], .iov_len = 10 },
+        { .iov_base = big, .iov_len = sizeof(big) }
+    };
+    ASSERT(mqlog_writev(lg, big_iov, 2, &offset) == ELNOWCP);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(mqlog_reserve_commit) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_reserve_commit";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, size, 0);
+    ASSERT(rc == 0);
+    ASSERT(lg);
+
+    void* ptr = NULL;
+    mqlog_ticket_t ticket0;
+    rc = mqlog_reserve(lg, 1000, &ptr, &ticket0);
+    ASSERT(rc == 0);
+    ASSERT(ptr);
+    memset(ptr, 'a', 1000);
+
+    // reserved frames are claimed in order
+    void* ptr1 = NULL;
+    mqlog_ticket_t ticket1;
+    rc = mqlog_reserve(lg, 2000, &ptr1, &ticket1);
+    ASSERT(rc == 0);
+    ASSERT(ticket1.offset == ticket0.offset + 1);
+    memset(ptr1, 'b', 2000);
+
+    // nothing is visible before the commit
+    struct frame fr;
+    ASSERT(mqlog_read(lg, 0, &fr) < 0);
+
+    uint64_t offset = 42;
+    ssize_t written = mqlog_commit(lg, &ticket1, &offset);
+    ASSERT(written == 2000);
+    ASSERT(offset == 1);
+
+    ASSERT(mqlog_read(lg, 0, &fr) < 0);
+
+    written = mqlog_commit(lg, &ticket0, &offset);
+    ASSERT(written == 1000);
+    ASSERT(offset == 0);
+
+    ssize_t read = mqlog_read(lg, 0, &fr);
+    ASSERT(read == 1000);
+    ASSERT(fr.buffer[0] == 'a' && fr.buffer[999] == 'a');
+
+    read = mqlog_read(lg, 1, &fr);
+    ASSERT(read == 2000);
+    ASSERT(fr.buffer[0] == 'b' && fr.buffer[1999] == 'b');
+
+    // does not fit in the first segment
+    rc = mqlog_reserve(lg, 2000, &ptr, &ticket0);
+    ASSERT(rc == 0);
+    ASSERT(ticket0.offset == 2);
+    memset(ptr, 'c', 2000);
+    written = mqlog_commit(lg, &ticket0, &offset);
+    ASSERT(written == 2000);
+    ASSERT(offset == 2);
+
+    read = mqlog_read(lg, 2, &fr);
+    ASSERT(read == 2000);
+    ASSERT(fr.buffer[0] == 'c' && fr.buffer[1999] == 'c');
+
+    ASSERT(mqlog_reserve(lg, size, &ptr, &ticket0) == ELNOWCP);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(mqlog_prepare_segment) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_prepare_segment";
+    const char* spare = "/tmp/mqlog_prepare_segment/log.spare";
+
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = MQLOG_PREPARE;
+    options.prepare_threshold = 50;
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open_options(&lg, dir, size, &options);
+    ASSERT(rc == 0);
+    ASSERT(lg);
+
+    unsigned char payload[100];
+    memset(payload, 'x', sizeof(payload));
+
+    // the first segment is created by the first write
+    ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+    ASSERT(!file_exists(spare));
+
+    // past the threshold the next segment is prepared
+    for (int i = 0; i < 20; ++i) {
+        ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+    }
+    for (int i = 0; i < 1000 && !file_exists(spare); ++i) {
+        usleep(1000);
+    }
+    ASSERT(file_exists(spare));
+
+    // the roll activates the spare segment
+    enum { FRAMES = 500 };
+    for (int i = 21; i < FRAMES; ++i) {
+        memset(payload, i % 256, sizeof(payload));
+        ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+    }
+
+    struct frame fr;
+    for (int i = 21; i < FRAMES; ++i) {
+        ASSERT(mqlog_read(lg, i, &fr) == 100);
+        ASSERT(fr.buffer[0] == i % 256 && fr.buffer[99] == i % 256);
+    }
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // spare segments are not part of the log
+    ASSERT(!file_exists(spare));
+}
+
+static int count_mappings(const char* dir) {
+    FILE* f = fopen("/proc/self/maps", "r");
+    if (!f) {
+        return -1;
+    }
+
+    int count = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        if (strstr(line, dir) && strstr(line, ".log")) {
+            ++count;
+        }
+    }
+
+    fclose(f);
+    return count;
+}
+
+TEST(mqlog_mapping_budget) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_mapping_budget";
+
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.max_mapped_segments = 2;
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open_options(&lg, dir, size, &options);
+    ASSERT(rc == 0);
+
+    // 36 frames per segment
+    enum { FRAMES = 720 };
+    unsigned char payload[100];
+    for (int i = 0; i < FRAMES; ++i) {
+        memset(payload, i % 256, sizeof(payload));
+        ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+    }
+
+    // sealed segments beyond the budget have been unmapped,
+    // the active segment is not part of it
+    ASSERT(count_mappings(dir) <= 3);
+
+    struct frame fr;
+    for (int round = 0; round < 2; ++round) {
+        for (int i = 0; i < FRAMES; ++i) {
+            ASSERT(mqlog_read(lg, i, &fr) == 100);
+            ASSERT(fr.buffer[0] == i % 256 && fr.buffer[99] == i % 256);
+        }
+        ASSERT(count_mappings(dir) <= 3);
+    }
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(mqlog_reopen_many_segments) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_reopen_many_segments";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    int rc = mqlog_open(&lg, dir, size, 0);
+    ASSERT(rc == 0);
+
+    // 36 frames per segment, directory order isn't sorted
+    enum { FRAMES = 36 * 50 + 7 };
+    unsigned char payload[100];
+    for (int i = 0; i < FRAMES; ++i) {
+        memset(payload, i % 256, sizeof(payload));
+        ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+    }
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    rc = mqlog_open(&lg, dir, size, 0);
+    ASSERT(rc == 0);
+
+    // writes continue after the last frame of the tail segment
+    memset(payload, FRAMES % 256, sizeof(payload));
+    ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+
+    struct frame fr;
+    for (int i = 0; i <= FRAMES; ++i) {
+        ASSERT(mqlog_read(lg, i, &fr) == 100);
+        ASSERT(fr.buffer[0] == i % 256 && fr.buffer[99] == i % 256);
+    }
+    ASSERT(mqlog_read(lg, FRAMES + 1, &fr) == ELNORD);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+static int copy_file(const char* from, const char* to) {
+    FILE* in = fopen(from, "rb");
+    if (!in) {
+        return -1;
+    }
+    FILE* out = fopen(to, "wb");
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        fwrite(buf, 1, n, out);
+    }
+
+    fclose(in);
+    return fclose(out);
+}
+
+static int write_frames(mqlog_t* lg, int from, int to) {
+    unsigned char payload[100];
+    for (int i = from; i < to; ++i) {
+        memset(payload, i % 256, sizeof(payload));
+        if (mqlog_write(lg, payload, sizeof(payload)) != 100) {
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+static int read_frames(mqlog_t* lg, int from, int to) {
+    struct frame fr;
+    for (int i = from; i < to; ++i) {
+        if (mqlog_read(lg, i, &fr) != 100 ||
+            fr.buffer[0] != i % 256 ||
+            fr.buffer[99] != i % 256) {
+            return -1;
+        }
+    }
+
+    return mqlog_read(lg, to, &fr) == ELNORD ? 0 : -1;
+}
+
+TEST(mqlog_manifest) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_manifest";
+    const char* manifest = "/tmp/mqlog_manifest/MANIFEST";
+    const char* stale = "/tmp/mqlog_manifest_stale";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+
+    // 36 frames per segment
+    ASSERT(write_frames(lg, 0, 100) == 0);
+    ASSERT(file_exists(manifest));
+    ASSERT(copy_file(manifest, stale) == 0);
+
+    ASSERT(write_frames(lg, 100, 300) == 0);
+    ASSERT(mqlog_sync(lg) > 0);
+    ASSERT(write_frames(lg, 300, 310) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // the checkpoint is followed by unsynced frames
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+    ASSERT(read_frames(lg, 0, 310) == 0);
+    ASSERT(write_frames(lg, 310, 320) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // segments created after the manifest was written are found
+    ASSERT(copy_file(stale, manifest) == 0);
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+    ASSERT(read_frames(lg, 0, 320) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // without manifest, the log is loaded from the segment files
+    ASSERT(unlink(manifest) == 0);
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+    ASSERT(file_exists(manifest));
+    ASSERT(read_frames(lg, 0, 320) == 0);
+    ASSERT(write_frames(lg, 320, 330) == 0);
+    ASSERT(read_frames(lg, 0, 330) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    unlink(stale);
+}
+
+static int overwrite_file(const char* path, off_t offset,
+                          const void* buf, size_t size) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    const ssize_t written = pwrite(fd, buf, size, offset);
+    close(fd);
+    return written == (ssize_t)size ? 0 : -1;
+}
+
+TEST(mqlog_recover) {
+    const size_t size = 4096;
+    const size_t frame_size = 112;
+    const char* dir = "/tmp/mqlog_recover";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+
+    // 36 frames per segment: segments 0, 36 and 72
+    ASSERT(write_frames(lg, 0, 100) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // nothing has been synced
+    ASSERT(unlink("/tmp/mqlog_recover/MANIFEST") == 0);
+
+    // payload of frame 30 corrupted
+    const unsigned char garbage = 0xff;
+    ASSERT(overwrite_file("/tmp/mqlog_recover/0.log",
+                          30 * frame_size + 20, &garbage, 1) == 0);
+
+    // index entry of frame 80 lost
+    const uint32_t position = 0;
+    ASSERT(overwrite_file("/tmp/mqlog_recover/72.idx",
+                          16 + 8 * sizeof(uint32_t),
+                          &position, sizeof(position)) == 0);
+
+    // frame 90 claimed, never written
+    const uint16_t flags = HEADER_FLAGS_EMPTY;
+    ASSERT(overwrite_file("/tmp/mqlog_recover/72.log",
+                          18 * frame_size, &flags, sizeof(flags)) == 0);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = MQLOG_RECOVER;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    struct frame fr;
+    for (int i = 0; i < 30; ++i) {
+        ASSERT(mqlog_read(lg, i, &fr) == 100);
+        ASSERT(fr.buffer[0] == i);
+    }
+    for (int i = 30; i < 36; ++i) {
+        ASSERT(mqlog_read(lg, i, &fr) == ELLOST);
+    }
+    ASSERT(mqlog_read(lg, 36, &fr) == 100);
+    ASSERT(mqlog_read(lg, 80, &fr) == 100);
+    ASSERT(fr.buffer[0] == 80);
+    ASSERT(mqlog_read(lg, 89, &fr) == 100);
+    ASSERT(mqlog_read(lg, 90, &fr) == ELNORD);
+
+    // cursors skip the offsets lost
+    mqlog_cursor_t cursor;
+    mqlog_cursor_init(lg, 28, &cursor);
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == 100 && fr.buffer[0] == 28);
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == 100 && fr.buffer[0] == 29);
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == 100 && fr.buffer[0] == 36);
+    mqlog_cursor_close(&cursor);
+
+    // writes continue after the last valid frame
+    ASSERT(write_frames(lg, 90, 100) == 0);
+    ASSERT(read_frames(lg, 36, 100) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // recovering again finds the same frames
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(mqlog_read(lg, 29, &fr) == 100);
+    ASSERT(mqlog_read(lg, 30, &fr) == ELLOST);
+    ASSERT(read_frames(lg, 36, 100) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+static void cursor_read(int* __errors,
+                        unsigned int index_interval,
+                        const char* dir) {
+    const size_t size = 4096;
+
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.index_interval = index_interval;
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    // 36 frames per segment
+    ASSERT(write_frames(lg, 0, 200) == 0);
+
+    struct frame fr;
+    mqlog_cursor_t cursor;
+    mqlog_cursor_init(lg, 0, &cursor);
+    for (int i = 0; i < 200; ++i) {
+        ASSERT(mqlog_cursor_next(&cursor, &fr) == 100);
+        ASSERT(fr.buffer[0] == i % 256 && fr.buffer[99] == i % 256);
+    }
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == ELNORD);
+    ASSERT(cursor.offset == 200);
+
+    // the cursor resumes with the frames written afterwards
+    ASSERT(write_frames(lg, 200, 300) == 0);
+    for (int i = 200; i < 300; ++i) {
+        ASSERT(mqlog_cursor_next(&cursor, &fr) == 100);
+        ASSERT(fr.buffer[0] == i % 256);
+    }
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == ELNORD);
+    mqlog_cursor_close(&cursor);
+
+    // from the middle of a segment
+    mqlog_cursor_init(lg, 50, &cursor);
+    for (int i = 50; i < 300; ++i) {
+        ASSERT(mqlog_cursor_next(&cursor, &fr) == 100);
+        ASSERT(fr.buffer[0] == i % 256);
+    }
+    mqlog_cursor_close(&cursor);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(mqlog_cursor) {
+    cursor_read(__errors, 1, "/tmp/mqlog_cursor");
+    cursor_read(__errors, 8, "/tmp/mqlog_cursor_sparse");
+}
+
+TEST(mqlog_readv_frames) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_readv";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+
+    // 36 frames per segment
+    ASSERT(write_frames(lg, 0, 100) == 0);
+
+    // up to the end of the segment
+    struct frame frames[64];
+    ASSERT(mqlog_readv(lg, 0, frames, 64, size) == 36);
+    for (int i = 0; i < 36; ++i) {
+        ASSERT(frame_payload_size(&frames[i]) == 100);
+        ASSERT(frames[i].buffer[0] == i && frames[i].buffer[99] == i);
+    }
+
+    // up to the limits
+    ASSERT(mqlog_readv(lg, 40, frames, 10, size) == 10);
+    ASSERT(frames[9].buffer[0] == 49);
+    ASSERT(mqlog_readv(lg, 40, frames, 10, 250) == 2);
+    ASSERT(mqlog_readv(lg, 40, frames, 10, 0) == 1);
+    ASSERT(frames[0].buffer[0] == 40);
+
+    // up to the last frame written
+    ASSERT(mqlog_readv(lg, 90, frames, 64, size) == 10);
+    ASSERT(frames[9].buffer[0] == 99);
+    ASSERT(mqlog_readv(lg, 100, frames, 64, size) == ELNORD);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // up to the frames synced
+    delete_directory(dir);
+    ASSERT(mqlog_open(&lg, dir, size, MQLOG_RDCMT) == 0);
+    ASSERT(write_frames(lg, 0, 10) == 0);
+    ASSERT(mqlog_readv(lg, 0, frames, 64, size) == ELNORD);
+    ASSERT(mqlog_sync(lg) > 0);
+    ASSERT(write_frames(lg, 10, 20) == 0);
+    ASSERT(mqlog_readv(lg, 0, frames, 64, size) == 10);
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+struct delayed_write {
+    mqlog_t* lg;
+    int      value;
+};
+
+static void* write_later(void* arg) {
+    struct delayed_write* args = (struct delayed_write*)arg;
+
+    usleep(20000);
+    unsigned char payload[100];
+    memset(payload, args->value, sizeof(payload));
+    mqlog_write(args->lg, payload, sizeof(payload));
+
+    return NULL;
+}
+
+TEST(mqlog_read_wait_notify) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_read_wait_notify";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, MQLOG_EVENTFD) == 0);
+    ASSERT(write_frames(lg, 0, 10) == 0);
+
+    // frames already written are returned straight away
+    struct frame fr;
+    const struct timespec timeout = {
+        .tv_sec = 0,
+        .tv_nsec = 10000000
+    };
+    ASSERT(mqlog_read_wait(lg, 9, &fr, &timeout) == 100);
+    ASSERT(mqlog_read_wait(lg, 10, &fr, &timeout) == ELNORD);
+
+    // the reader parked is woken up by the producer
+    pthread_t producer;
+    struct delayed_write args = {
+        .lg = lg,
+        .value = 10
+    };
+    ASSERT(pthread_create(&producer, NULL, write_later, &args) == 0);
+    ASSERT(mqlog_read_wait(lg, 10, &fr, NULL) == 100);
+    ASSERT(fr.buffer[0] == 10);
+    ASSERT(pthread_join(producer, NULL) == 0);
+
+    // the eventfd is signaled once armed
+    const int fd = mqlog_eventfd(lg);
+    ASSERT(fd >= 0);
+    ASSERT(mqlog_arm(lg, 10) == 1);
+    uint64_t events = 0;
+    while (read(fd, &events, sizeof(events)) == sizeof(events)) {
+    }
+
+    ASSERT(mqlog_arm(lg, 11) == 0);
+    struct pollfd pfd = {
+        .fd = fd,
+        .events = POLLIN
+    };
+    ASSERT(poll(&pfd, 1, 0) == 0);
+    ASSERT(write_frames(lg, 11, 13) == 0);
+    ASSERT(poll(&pfd, 1, 0) == 1);
+    ASSERT(read(fd, &events, sizeof(events)) == sizeof(events));
+    ASSERT(events == 1);
+    ASSERT(mqlog_read(lg, 11, &fr) == 100);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // without MQLOG_EVENTFD
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+    ASSERT(mqlog_eventfd(lg) == ELEVTFD);
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(mqlog_ready_watermark) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_ready_watermark";
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+
+    // frames committed out of order
+    void* first = NULL;
+    void* second = NULL;
+    mqlog_ticket_t first_ticket;
+    mqlog_ticket_t second_ticket;
+    ASSERT(mqlog_reserve(lg, 100, &first, &first_ticket) == 0);
+    ASSERT(mqlog_reserve(lg, 100, &second, &second_ticket) == 0);
+    memset(first, 0, 100);
+    memset(second, 1, 100);
+
+    uint64_t offset = 0;
+    struct frame fr;
+    ASSERT(mqlog_commit(lg, &second_ticket, &offset) == 100);
+    ASSERT(offset == 1);
+
+    // the second frame is ready, not the frames before it
+    ASSERT(mqlog_read(lg, 0, &fr) == ELNORD);
+    ASSERT(mqlog_read(lg, 1, &fr) == ELNORD);
+
+    ASSERT(mqlog_commit(lg, &first_ticket, &offset) == 100);
+    ASSERT(mqlog_read(lg, 0, &fr) == 100 && fr.buffer[0] == 0);
+    ASSERT(mqlog_read(lg, 1, &fr) == 100 && fr.buffer[0] == 1);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // committed reads progress without syncing
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = MQLOG_RDCMT;
+    options.sync_policy = MQLOG_SYNC_INTERVAL;
+    options.sync_interval_ms = 1;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    ASSERT(write_frames(lg, 0, 100) == 0);
+    const struct timespec timeout = {
+        .tv_sec = 5,
+        .tv_nsec = 0
+    };
+    ASSERT(mqlog_read_wait(lg, 99, &fr, &timeout) == 100);
+    ASSERT(fr.buffer[0] == 99);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+struct sync_writer {
+    mqlog_t* lg;
+    int      failed;
+};
+
+static void* write_synced(void* arg) {
+    struct sync_writer* writer = (struct sync_writer*)arg;
+
+    unsigned char payload[100];
+    memset(payload, 0, sizeof(payload));
+    for (int i = 0; i < 50; ++i) {
+        if (mqlog_write(writer->lg, payload, sizeof(payload)) != 100) {
+            writer->failed = 1;
+        }
+    }
+
+    return NULL;
+}
+
+TEST(mqlog_sync_policy) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_sync_policy";
+
+    delete_directory(dir);
+
+    // frames are synced on `mqlog_sync` only, sealed segments included
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = MQLOG_RDCMT;
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 100) == 0);
+    ASSERT(mqlog_durable_offset(lg) == 0);
+
+    struct frame fr;
+    ASSERT(mqlog_read(lg, 0, &fr) == ELNORD);
+    ASSERT(mqlog_sync(lg) > 0);
+    ASSERT(mqlog_durable_offset(lg) == 100);
+    ASSERT(read_frames(lg, 0, 100) == 0);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // writes return once synced
+    delete_directory(dir);
+    options.sync_policy = MQLOG_SYNC_WRITE;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    unsigned char payload[100];
+    memset(payload, 0, sizeof(payload));
+    for (int i = 0; i < 100; ++i) {
+        ASSERT(mqlog_write(lg, payload, sizeof(payload)) == 100);
+        ASSERT(mqlog_durable_offset(lg) >= (uint64_t)i + 1);
+        ASSERT(mqlog_read(lg, i, &fr) == 100);
+    }
+
+    // empty payloads are not waited for
+    struct iovec iov[2] = {
+        { .iov_base = payload, .iov_len = sizeof(payload) },
+        { .iov_base = payload, .iov_len = 0 }
+    };
+    uint64_t offset = 0;
+    ASSERT(mqlog_writev(lg, iov, 2, &offset) == 100);
+    ASSERT(offset == 100);
+    ASSERT(mqlog_durable_offset(lg) == 101);
+    ASSERT(mqlog_writev(lg, iov + 1, 1, &offset) == 0);
+    ASSERT(offset == 100);
+    ASSERT(mqlog_read(lg, 101, &fr) == ELNORD);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // concurrent writes share syncs
+    delete_directory(dir);
+    options.flags = MQLOG_RDCMT | MQLOG_WRBLK;
+    options.sync_policy = MQLOG_SYNC_GROUP;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    enum { WRITERS = 4 };
+    pthread_t threads[WRITERS];
+    struct sync_writer writers[WRITERS];
+    for (int i = 0; i < WRITERS; ++i) {
+        writers[i].lg = lg;
+        writers[i].failed = 0;
+        ASSERT(pthread_create(&threads[i], NULL, write_synced,
+                              &writers[i]) == 0);
+    }
+    for (int i = 0; i < WRITERS; ++i) {
+        ASSERT(pthread_join(threads[i], NULL) == 0);
+        ASSERT(!writers[i].failed);
+    }
+
+    ASSERT(mqlog_durable_offset(lg) == WRITERS * 50);
+    ASSERT(mqlog_read(lg, WRITERS * 50 - 1, &fr) == 100);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // frames synced every few bytes written
+    delete_directory(dir);
+    options.sync_policy = MQLOG_SYNC_BYTES;
+    options.sync_bytes = 1024;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 100) == 0);
+
+    const struct timespec timeout = {
+        .tv_sec = 5,
+        .tv_nsec = 0
+    };
+    ASSERT(mqlog_read_wait(lg, 90, &fr, &timeout) == 100);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+static void record_durable(uint64_t offset, void* arg) {
+    *(volatile uint64_t*)arg = offset;
+}
+
+TEST(mqlog_write_async_durable) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_write_async_durable";
+
+    delete_directory(dir);
+
+    // without a worker, waiting flushes
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+
+    unsigned char payload[100];
+    uint64_t offset = 0;
+    for (int i = 0; i < 100; ++i) {
+        memset(payload, i, sizeof(payload));
+        ASSERT(mqlog_write_async(lg, payload, sizeof(payload), &offset) ==
+               100);
+        ASSERT(offset == (uint64_t)i);
+    }
+    ASSERT(mqlog_durable_offset(lg) == 0);
+
+    ASSERT(mqlog_wait_durable(lg, 99, NULL) == 0);
+    ASSERT(mqlog_durable_offset(lg) == 100);
+    ASSERT(read_frames(lg, 0, 100) == 0);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // the worker flushes, the callback gets the durable offset
+    delete_directory(dir);
+
+    volatile uint64_t durable = 0;
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.sync_policy = MQLOG_SYNC_INTERVAL;
+    options.sync_interval_ms = 60000;
+    options.on_durable = record_durable;
+    options.on_durable_arg = (void*)&durable;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+
+    // a frame not committed holds back the ones after it
+    void* ptr = NULL;
+    mqlog_ticket_t ticket;
+    ASSERT(mqlog_reserve(lg, 100, &ptr, &ticket) == 0);
+    memset(ptr, 0, 100);
+    ASSERT(mqlog_write_async(lg, payload, sizeof(payload), &offset) == 100);
+    ASSERT(offset == 1);
+
+    const struct timespec timeout = {
+        .tv_sec = 0,
+        .tv_nsec = 20000000
+    };
+    ASSERT(mqlog_wait_durable(lg, 1, &timeout) == ELTMOUT);
+
+    ASSERT(mqlog_commit(lg, &ticket, &offset) == 100);
+    ASSERT(mqlog_wait_durable(lg, 1, NULL) == 0);
+    ASSERT(mqlog_durable_offset(lg) == 2);
+    ASSERT(durable == 2);
+
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+static int file_byte(const char* path, off_t offset) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+
+    unsigned char byte = 0;
+    const ssize_t n = pread(fd, &byte, 1, offset);
+    close(fd);
+    return n == 1 ? byte : -1;
+}
+
+static int check_engine(const char* dir, unsigned int flags) {
+    const size_t size = 4096;
+    const size_t header_size = 12;
+
+    delete_directory(dir);
+
+    mqlog_t* lg = NULL;
+    if (mqlog_open(&lg, dir, size, flags) != 0 ||
+        write_frames(lg, 0, 100) != 0 ||
+        read_frames(lg, 0, 100) != 0) {
+        return -1;
+    }
+
+    // frames of the active segment are staged until synced
+    char path[256];
+    snprintf(path, sizeof(path), "%s/72.log", dir);
+    if (file_byte(path, header_size) != 0 ||
+        mqlog_sync(lg) <= 0 ||
+        file_byte(path, header_size) != 72 ||
+        mqlog_close(lg) != 0) {
+        return -1;
+    }
+
+    // written back frames are read from the files, and appended to
+    if (mqlog_open(&lg, dir, size, 0) != 0 ||
+        read_frames(lg, 0, 100) != 0 ||
+        write_frames(lg, 100, 110) != 0 ||
+        mqlog_close(lg) != 0 ||
+        mqlog_open(&lg, dir, size, flags) != 0 ||
+        write_frames(lg, 110, 120) != 0 ||
+        mqlog_close(lg) != 0) {
+        return -1;
+    }
+
+    if (mqlog_open(&lg, dir, size, 0) != 0 ||
+        read_frames(lg, 0, 120) != 0) {
+        return -1;
+    }
+
+    return mqlog_close(lg);
+}
+
+TEST(mqlog_pwrite_engine) {
+    ASSERT(check_engine("/tmp/mqlog_pwrite_engine", MQLOG_PWRITE) == 0);
+    ASSERT(check_engine("/tmp/mqlog_pwrite_engine", MQLOG_DIRECT) == 0);
+}
+
+static int count_segment_files(const char* dir) {
+    DIR* d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (strstr(entry->d_name, ".log")) {
+            ++count;
+        }
+    }
+
+    closedir(d);
+    return count;
+}
+
+static int wait_expired(mqlog_t* lg,
+                        const char* dir,
+                        uint64_t offset,
+                        int files) {
+    // Segments are deleted in the background, their files last.
+    struct frame fr;
+    for (int i = 0; i < 5000; ++i) {
+        if (mqlog_read(lg, offset, &fr) == ELOSLOW &&
+            count_segment_files(dir) == files) {
+            return 0;
+        }
+        usleep(1000);
+    }
+
+    return -1;
+}
+
+TEST(mqlog_retention) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_retention";
+
+    // 36 frames per segment, the active segment counts
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.max_retained_segments = 2;
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 10) == 0);
+
+    // an idle cursor doesn't keep its segment
+    struct frame fr;
+    mqlog_cursor_t idle;
+    mqlog_cursor_init(lg, 0, &idle);
+    ASSERT(mqlog_cursor_next(&idle, &fr) >= 0);
+
+    ASSERT(write_frames(lg, 10, 720) == 0);
+    ASSERT(wait_expired(lg, dir, 647, 2) == 0);
+    ASSERT(mqlog_cursor_next(&idle, &fr) == ELOSLOW);
+    mqlog_cursor_close(&idle);
+
+    ASSERT(mqlog_read(lg, 0, &fr) == ELOSLOW);
+    ASSERT(read_frames(lg, 648, 720) == 0);
+
+    mqlog_cursor_t cursor;
+    mqlog_cursor_init(lg, 0, &cursor);
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == ELOSLOW);
+    mqlog_cursor_close(&cursor);
+
+    ASSERT(mqlog_close(lg) == 0);
+
+    // expired segments are not loaded again
+    ASSERT(mqlog_open(&lg, dir, size, 0) == 0);
+    ASSERT(mqlog_read(lg, 647, &fr) == ELOSLOW);
+    ASSERT(read_frames(lg, 648, 720) == 0);
+    ASSERT(write_frames(lg, 720, 730) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // an idle cursor at the end of an expired segment
+    delete_directory(dir);
+    mqlog_options_init(&options);
+    options.max_retained_segments = 1;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 36) == 0);
+    mqlog_cursor_init(lg, 0, &idle);
+    for (int i = 0; i < 36; ++i) {
+        ASSERT(mqlog_cursor_next(&idle, &fr) == 100);
+    }
+    ASSERT(write_frames(lg, 36, 37) == 0);
+    ASSERT(wait_expired(lg, dir, 35, 1) == 0);
+    ASSERT(mqlog_cursor_next(&idle, &fr) == 100);
+    ASSERT(fr.buffer[0] == 36);
+    mqlog_cursor_close(&idle);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // by size
+    delete_directory(dir);
+    mqlog_options_init(&options);
+    options.max_retained_bytes = 3 * size;
+    options.max_mapped_segments = 2;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 720) == 0);
+    ASSERT(wait_expired(lg, dir, 611, 3) == 0);
+    ASSERT(read_frames(lg, 612, 720) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // by age
+    delete_directory(dir);
+    mqlog_options_init(&options);
+    options.max_segment_age_ms = 20;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 100) == 0);
+    ASSERT(wait_expired(lg, dir, 71, 1) == 0);
+    ASSERT(read_frames(lg, 72, 100) == 0);
+    ASSERT(write_frames(lg, 100, 110) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+static int pooled_files(const char* dir, ino_t* inodes, int max) {
+    // Inodes of the pooled data files.
+    DIR* d = opendir(dir);
+    if (!d) {
+        return -1;
+    }
+
+    int count = 0;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        char path[256];
+        struct stat st;
+        if (!has_suffix(entry->d_name, ".log.pool") ||
+            append_file_to_dir(path, sizeof(path), dir,
+                               entry->d_name) != 0 ||
+            stat(path, &st) != 0) {
+            continue;
+        }
+        if (count < max) {
+            inodes[count] = st.st_ino;
+        }
+        ++count;
+    }
+
+    closedir(d);
+    return count;
+}
+
+TEST(mqlog_recycle) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_recycle";
+
+    // 36 frames per segment
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.flags = MQLOG_RECYCLE;
+    options.max_retained_segments = 2;
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 110) == 0);
+
+    // the files of expired segments are pooled once unmapped, a
+    // segment still pinned by a writer is only unmapped later
+    ino_t inodes[2] = {0, 0};
+    struct frame fr;
+    int pooled = 0;
+    for (int i = 0; i < 5000 && pooled == 0; ++i) {
+        usleep(1000);
+        pooled = pooled_files(dir, inodes, 2);
+    }
+    ASSERT(pooled > 0);
+    ASSERT(mqlog_read(lg, 71, &fr) == ELOSLOW);
+
+    // and reused by the next segment, cleared
+    ASSERT(write_frames(lg, 110, 150) == 0);
+    struct stat st;
+    ASSERT(stat("/tmp/mqlog_recycle/144.log", &st) == 0);
+    ASSERT(st.st_ino == inodes[0] || st.st_ino == inodes[1]);
+    ASSERT(read_frames(lg, 108, 150) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+    ASSERT(pooled_files(dir, inodes, 2) == 0);
+
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(read_frames(lg, 108, 150) == 0);
+    ASSERT(mqlog_close(lg) == 0);
+
+    // pooled files are deleted beyond the limit
+    delete_directory(dir);
+    options.max_pooled_segments = 1;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 720) == 0);
+    ASSERT(read_frames(lg, 648, 720) == 0);
+    ASSERT(pooled_files(dir, inodes, 2) <= 1);
+    ASSERT(mqlog_close(lg) == 0);
+}
+
+TEST(mqlog_read_section) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/mqlog_read_section";
+
+    delete_directory(dir);
+
+    struct mqlog_options options;
+    mqlog_options_init(&options);
+    options.max_mapped_segments = 1;
+
+    mqlog_t* lg = NULL;
+    ASSERT(mqlog_open_options(&lg, dir, size, &options) == 0);
+    ASSERT(write_frames(lg, 0, 720) == 0);
+
+    // the frame stays valid while its segment is unmapped
+    mqlog_reader_t* reader = NULL;
+    ASSERT(mqlog_reader_open(lg, &reader) == 0);
+    mqlog_enter(reader);
+
+    struct frame first;
+    ASSERT(mqlog_read(lg, 0, &first) == 100);
+    ASSERT(read_frames(lg, 36, 720) == 0);
+    ASSERT(first.buffer[0] == 0 && first.buffer[99] == 0);
+    ASSERT(count_mappings(dir) > 3);
+
+    // and is unmapped once the section is left
+    mqlog_exit(reader);
+    ASSERT(read_frames(lg, 0, 720) == 0);
+    ASSERT(count_mappings(dir) <= 3);
+
+    // a cursor leaves its section between reads
+    mqlog_cursor_t cursor;
+    struct frame fr;
+    ASSERT(mqlog_cursor_init(lg, 0, &cursor) == 0);
+    ASSERT(mqlog_cursor_next(&cursor, &fr) == 100);
+    ASSERT(read_frames(lg, 36, 720) == 0);
+    ASSERT(count_mappings(dir) <= 3);
+    mqlog_cursor_close(&cursor);
+
+    // a held cursor's frame stays valid until the next frame is read
+    ASSERT(mqlog_cursor_init(lg, 0, &cursor) == 0);
+    mqlog_cursor_hold(&cursor);
+    struct frame other;
+    for (int i = 0; i < 720; ++i) {
+        ASSERT(mqlog_cursor_next(&cursor, &fr) == 100);
+        ASSERT(mqlog_read(lg, (i + 360) % 720, &other) == 100);
+        ASSERT(fr.buffer[0] == i % 256 && fr.buffer[99] == i % 256);
+    }
+    mqlog_cursor_close(&cursor);
+
+    mqlog_reader_close(reader);
+    ASSERT(mqlog_close(lg) == 0);
+}
@@ -4,6 +4,7 @@
 #include <segment.h>
 #include <mqlogerrno.h>
 #include <string.h>
+#include <stdio.h>
 
 TEST(segment_write_read) {
     const size_t size = 10485760; // 10 MB
@@ -12,18 +13,18 @@ TEST(segment_write_read) {
     ASSERT(delete_directory(dir) == 0);
 
     segment_t* sgm = NULL;
-    int rc = segment_open(&sgm, dir, 0, size, 0);
+    int rc = segment_open(&sgm, dir, 0, size, 0, 1);
     ASSERT(rc == 0);
     ASSERT(sgm);
 
     const char* str = "Lorem ipsum dolor sit amet, etc ...";
     const size_t str_size = strlen(str);
-    ssize_t written = segment_write(sgm, str, str_size);
+    ssize_t written = segment_write(sgm, str, str_size, NULL);
     ASSERT(str_size == (size_t)written);
 
     const char* str2 = "what's up?";
     const size_t str2_size = strlen(str2);
-    written = segment_write(sgm, str2, str2_size);
+    written = segment_write(sgm, str2, str2_size, NULL);
     ASSERT(str2_size == (size_t)written);
 
     uint64_t offset = 0;
@@ -54,24 +55,24 @@ TEST(segment_write_close_open_read) {
     ASSERT(delete_directory(dir) == 0);
 
     segment_t* sgm = NULL;
-    int rc = segment_open(&sgm, dir, 0, size, 0);
+    int rc = segment_open(&sgm, dir, 0, size, 0, 1);
     ASSERT(rc == 0);
     ASSERT(sgm);
 
     const int n = 14434;
     const size_t n_size = sizeof(n);
-    ssize_t written = segment_write(sgm, &n, n_size);
+    ssize_t written = segment_write(sgm, &n, n_size, NULL);
     ASSERT(n_size == (size_t)written);
 
     const double d = 45435.2445;
     const size_t d_size = sizeof(d);
-    written = segment_write(sgm, &d, d_size);
+    written = segment_write(sgm, &d, d_size, NULL);
     ASSERT(d_size == (size_t)written);
 
     ASSERT(segment_close(sgm) == 0);
 
     sgm = NULL;
-    rc = segment_open(&sgm, dir, 0, size, 0);
+    rc = segment_open(&sgm, dir, 0, size, 0, 1);
     ASSERT(rc == 0);
     ASSERT(sgm);
 
@@ -104,32 +105,355 @@ TEST(segment_write_no_capacity) {
     ASSERT(delete_directory(dir) == 0);
 
     segment_t* sgm = NULL;
-    int rc =  segment_open(&sgm, dir, 0, size, 0);
+    int rc =  segment_open(&sgm, dir, 0, size, 0, 1);
     ASSERT(rc == 0);
     ASSERT(sgm);
 
     const size_t block0_size = 3000;
     unsigned char block0[block0_size];
     memset(block0, 0, block0_size);
-    ssize_t written = segment_write(sgm, block0, block0_size);
+    ssize_t written = segment_write(sgm, block0, block0_size, NULL);
     ASSERT((size_t)written == block0_size);
 
     const size_t block1_size = 1000;
-    written = segment_write(sgm, block0, block1_size);
+    written = segment_write(sgm, block0, block1_size, NULL);
     ASSERT(written == 1000);
 
     const size_t block2_size = 1100;
-    written = segment_write(sgm, block0, block2_size);
+    written = segment_write(sgm, block0, block2_size, NULL);
     ASSERT(written == ELEOS);
 
     const size_t block3_size = 5;
-    written = segment_write(sgm, block0, block3_size);
+    written = segment_write(sgm, block0, block3_size, NULL);
     ASSERT(written == ELEOS);
 
     // segment full
     const size_t block4_size = 3000;
-    written = segment_write(sgm, block0, block4_size);
+    written = segment_write(sgm, block0, block4_size, NULL);
     ASSERT(written == ELEOS);
 
     ASSERT(segment_close(sgm) == 0);
 }
+
+TEST(segment_prefault_window) {
+    const size_t size = 1048576; // 1 MB
+    const uint32_t window = 65536;
+    const char* dir = "/tmp/segment_prefault";
+
+    ASSERT(delete_directory(dir) == 0);
+
+    segment_t* sgm = NULL;
+    int rc = segment_open(&sgm, dir, 0, size, 0, 1);
+    ASSERT(rc == 0);
+    ASSERT(segment_faulted(sgm) == 0);
+
+    ASSERT(segment_prefault(sgm, window) == 0);
+    ASSERT(segment_faulted(sgm) == window);
+
+    // nothing to do until the write offset moves
+    ASSERT(segment_prefault(sgm, window) == 0);
+    ASSERT(segment_faulted(sgm) == window);
+
+    char buf[1000];
+    memset(buf, 'p', sizeof(buf));
+    for (int i = 0; i < 100; ++i) {
+        ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+    }
+
+    ASSERT(segment_prefault(sgm, window) == 0);
+    ASSERT(segment_faulted(sgm) == segment_data_offset(sgm) + window);
+
+    // pre-faulting doesn't alter written frames
+    struct frame fr;
+    for (int i = 0; i < 100; ++i) {
+        ASSERT(segment_read(sgm, i, &fr) == sizeof(buf));
+        ASSERT(memcmp(fr.buffer, buf, sizeof(buf)) == 0);
+    }
+
+    // the window is bounded by the segment size
+    ASSERT(segment_prefault(sgm, size) == 0);
+    ASSERT(segment_faulted(sgm) == size);
+
+    ASSERT(segment_close(sgm) == 0);
+}
+
+TEST(segment_sparse_index) {
+    const size_t size = 65536;
+    const char* dir = "/tmp/segment_sparse_index";
+
+    ASSERT(delete_directory(dir) == 0);
+
+    segment_t* sgm = NULL;
+    int rc = segment_open(&sgm, dir, 0, size, 0, 16);
+    ASSERT(rc == 0);
+
+    // payloads of different sizes, until the segment is full
+    char buf[64];
+    int frames = 0;
+    for (;; ++frames) {
+        memset(buf, frames % 256, sizeof(buf));
+        ssize_t written = segment_write(sgm, buf, 1 + frames % 64, NULL);
+        if (written == ELEOS) {
+            break;
+        }
+        ASSERT(written == 1 + frames % 64);
+    }
+    ASSERT(frames > 16);
+
+    struct frame fr;
+    for (int i = 0; i < frames; ++i) {
+        ASSERT(segment_read(sgm, i, &fr) == 1 + i % 64);
+        ASSERT(fr.buffer[0] == i % 256);
+    }
+    ASSERT(segment_read(sgm, frames, &fr) == ELNORD);
+
+    ASSERT(segment_close(sgm) == 0);
+
+    // the interval is stored in the index, not given at open
+    rc = segment_open(&sgm, dir, 0, size, 0, 1);
+    ASSERT(rc == 0);
+    ASSERT(segment_write_offset(sgm) == (uint64_t)frames);
+    ASSERT(segment_write(sgm, buf, 1, NULL) == ELEOS);
+
+    for (int i = 0; i < frames; ++i) {
+        ASSERT(segment_read(sgm, i, &fr) == 1 + i % 64);
+        ASSERT(fr.buffer[0] == i % 256);
+    }
+
+    ASSERT(segment_close(sgm) == 0);
+
+    // the index is 4 bytes per 16 frames, plus its header
+    ASSERT(file_size("/tmp/segment_sparse_index/0.idx") <
+           (ssize_t)(size / 13 / 16 * 4 + 64));
+}
+
+TEST(segment_dense_index_compatibility) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/segment_dense_index_compatibility";
+    const char* index = "/tmp/segment_dense_index_compatibility/0.idx";
+
+    ASSERT(delete_directory(dir) == 0);
+
+    segment_t* sgm = NULL;
+    int rc = segment_open(&sgm, dir, 0, size, 0, 1);
+    ASSERT(rc == 0);
+
+    char buf[10];
+    size_t positions[3];
+    size_t position = 0;
+    for (int i = 0; i < 3; ++i) {
+        memset(buf, 'a' + i, sizeof(buf));
+        ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+        positions[i] = position;
+        position += sizeof(struct header) + sizeof(buf);
+    }
+
+    ASSERT(segment_close(sgm) == 0);
+
+    // replace the index with a version 0 one: 8 bytes per frame
+    const size_t index_size = (size + 1) / sizeof(struct header);
+    char legacy[index_size];
+    memset(legacy, 0, index_size);
+    memcpy(legacy, positions, sizeof(positions));
+
+    FILE* f = fopen(index, "w");
+    ASSERT(f);
+    ASSERT(fwrite(legacy, 1, index_size, f) == index_size);
+    ASSERT(fclose(f) == 0);
+
+    rc = segment_open(&sgm, dir, 0, size, 0, 16);
+    ASSERT(rc == 0);
+    ASSERT(segment_write_offset(sgm) == 3);
+
+    struct frame fr;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(segment_read(sgm, i, &fr) == sizeof(buf));
+        ASSERT(fr.buffer[0] == 'a' + i);
+    }
+
+    // version 0 segments can be written until their index is full
+    for (int i = 3;; ++i) {
+        ssize_t written = segment_write(sgm, buf, 1, NULL);
+        if (written == ELEOS) {
+            ASSERT((size_t)i == index_size / sizeof(size_t));
+            break;
+        }
+        ASSERT(written == 1);
+    }
+
+    ASSERT(segment_read(sgm, 3, &fr) == 1);
+    ASSERT(file_size(index) == (ssize_t)index_size);
+
+    ASSERT(segment_close(sgm) == 0);
+}
+
+static int zero_index_entry(const char* index, long position, size_t size) {
+    FILE* f = fopen(index, "r+");
+    if (!f) {
+        return -1;
+    }
+
+    const uint64_t zero = 0;
+    const int rc = fseek(f, position, SEEK_SET) == 0 &&
+                   fwrite(&zero, 1, size, f) == size ? 0 : -1;
+    return fclose(f) == 0 ? rc : -1;
+}
+
+TEST(segment_index_hole) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/segment_index_hole";
+    const char* index = "/tmp/segment_index_hole/0.idx";
+
+    ASSERT(delete_directory(dir) == 0);
+
+    segment_t* sgm = NULL;
+    ASSERT(segment_open(&sgm, dir, 0, size, 0, 1) == 0);
+
+    char buf[10];
+    for (int i = 0; i < 10; ++i) {
+        memset(buf, 'a' + i, sizeof(buf));
+        ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+    }
+    ASSERT(segment_close(sgm) == 0);
+
+    // entries are published out of order: a crash left entry 5 empty,
+    // after its header (4 bytes entries)
+    ASSERT(zero_index_entry(index, 16 + 5 * 4, 4) == 0);
+
+    ASSERT(segment_open(&sgm, dir, 0, size, 0, 1) == 0);
+    ASSERT(segment_write_offset(sgm) == 5);
+
+    struct frame fr;
+    for (int i = 0; i < 5; ++i) {
+        ASSERT(segment_read(sgm, i, &fr) == sizeof(buf));
+        ASSERT(fr.buffer[0] == 'a' + i);
+    }
+    ASSERT(segment_read(sgm, 5, &fr) == ELNORD);
+
+    memset(buf, 'z', sizeof(buf));
+    ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+    ASSERT(segment_read(sgm, 5, &fr) == sizeof(buf));
+    ASSERT(fr.buffer[0] == 'z');
+    ASSERT(segment_close(sgm) == 0);
+
+    // same with a version 0 index: 8 bytes per frame
+    ASSERT(delete_directory(dir) == 0);
+    ASSERT(segment_open(&sgm, dir, 0, size, 0, 1) == 0);
+    size_t positions[3];
+    size_t position = 0;
+    for (int i = 0; i < 3; ++i) {
+        memset(buf, 'a' + i, sizeof(buf));
+        ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+        positions[i] = position;
+        position += sizeof(struct header) + sizeof(buf);
+    }
+    ASSERT(segment_close(sgm) == 0);
+
+    const size_t index_size = (size + 1) / sizeof(struct header);
+    char legacy[index_size];
+    memset(legacy, 0, index_size);
+    memcpy(legacy, positions, sizeof(positions));
+    FILE* f = fopen(index, "w");
+    ASSERT(f);
+    ASSERT(fwrite(legacy, 1, index_size, f) == index_size);
+    ASSERT(fclose(f) == 0);
+    ASSERT(zero_index_entry(index, 1 * 8, 8) == 0);
+
+    ASSERT(segment_open(&sgm, dir, 0, size, 0, 1) == 0);
+    ASSERT(segment_write_offset(sgm) == 1);
+    ASSERT(segment_read(sgm, 0, &fr) == sizeof(buf));
+    ASSERT(fr.buffer[0] == 'a');
+    ASSERT(segment_read(sgm, 1, &fr) == ELNORD);
+    ASSERT(segment_close(sgm) == 0);
+}
+
+static int read_index_entry(const char* index, long position, uint32_t* entry) {
+    FILE* f = fopen(index, "r");
+    if (!f) {
+        return -1;
+    }
+
+    const int rc = fseek(f, position, SEEK_SET) == 0 &&
+                   fread(entry, sizeof(uint32_t), 1, f) == 1 ? 0 : -1;
+    return fclose(f) == 0 ? rc : -1;
+}
+
+TEST(segment_pwrite_index) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/segment_pwrite_index";
+    const char* index = "/tmp/segment_pwrite_index/0.idx";
+
+    ASSERT(delete_directory(dir) == 0);
+
+    segment_t* sgm = NULL;
+    ASSERT(segment_open(&sgm, dir, 0, size, SGM_PWRITE, 1) == 0);
+
+    char buf[10];
+    memset(buf, 'a', sizeof(buf));
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+    }
+
+    // the header is on disk, the entries are staged with the data
+    uint32_t entry = 0;
+    ASSERT(read_index_entry(index, 0, &entry) == 0);
+    ASSERT(entry != 0);
+    ASSERT(read_index_entry(index, 16 + 2 * 4, &entry) == 0);
+    ASSERT(entry == 0);
+
+    ASSERT(segment_sync(sgm) == 3);
+    ASSERT(read_index_entry(index, 16 + 2 * 4, &entry) == 0);
+    ASSERT(entry == 2 * (sizeof(struct header) + sizeof(buf)));
+    ASSERT(segment_close(sgm) == 0);
+
+    ASSERT(segment_open(&sgm, dir, 0, size, SGM_PWRITE, 1) == 0);
+    ASSERT(segment_write_offset(sgm) == 3);
+    ASSERT(segment_close(sgm) == 0);
+}
+
+TEST(segment_final_offsets) {
+    const size_t size = 4096;
+    const char* dir = "/tmp/segment_final_offsets";
+
+    ASSERT(delete_directory(dir) == 0);
+
+    segment_t* sgm = NULL;
+    ASSERT(segment_open(&sgm, dir, 0, size, 0, 1) == 0);
+
+    char buf[10];
+    for (int i = 0; i < 3; ++i) {
+        memset(buf, 'a' + i, sizeof(buf));
+        ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) == sizeof(buf));
+    }
+    ASSERT(segment_seal(sgm) == 0);
+    ASSERT(segment_sync(sgm) == 3);
+
+    uint32_t index = 0;
+    uint32_t data = 0;
+    segment_synced(sgm, &index, &data);
+    ASSERT(index == 3);
+    ASSERT(data == size);
+    ASSERT(segment_close(sgm) == 0);
+
+    // the final offsets are taken as they are, the segment stays sealed
+    ASSERT(segment_register(&sgm, dir, 0, size, 0, 1) == 0);
+    segment_set_final(sgm, index, data);
+    ASSERT(segment_map(sgm) == 0);
+    ASSERT(segment_write_offset(sgm) == 3);
+    ASSERT(segment_sealed(sgm));
+
+    struct frame fr;
+    for (int i = 0; i < 3; ++i) {
+        ASSERT(segment_read(sgm, i, &fr) == sizeof(buf));
+        ASSERT(fr.buffer[0] == 'a' + i);
+    }
+    ASSERT(segment_read(sgm, 3, &fr) == ELNORD);
+    ASSERT(segment_write(sgm, buf, sizeof(buf), NULL) < 0);
+
+    // unmapped and mapped again, the write offsets are kept
+    ASSERT(segment_unmap(sgm) == 0);
+    ASSERT(segment_map(sgm) == 0);
+    ASSERT(segment_write_offset(sgm) == 3);
+    ASSERT(segment_sealed(sgm));
+    ASSERT(segment_close(sgm) == 0);
+}